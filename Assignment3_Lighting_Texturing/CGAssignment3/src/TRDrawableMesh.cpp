@@ -1,6 +1,10 @@
 #include "TRDrawableMesh.h"
 
 #include <map>
+#include <tuple>
+#include <cmath>
+#include <limits>
+#include <algorithm>
 #include <iostream>
 
 #define TINYOBJLOADER_IMPLEMENTATION
@@ -11,16 +15,37 @@
 
 namespace TinyRenderer
 {
+	constexpr unsigned int TRDrawableMesh::m_cluster_size;
 
-	TRDrawableMesh::TRDrawableMesh(const std::string &filename)
+	void TRVertexAttrib::reorder(const std::vector<unsigned int> &order)
 	{
-		loadMeshFromFile(filename);
+		for (auto stream : { &vx, &vy, &vz, &vr, &vg, &vb, &vnx, &vny, &vnz, &vu, &vv })
+		{
+			if (stream->empty())
+				continue;
+			TRAlignedVector<float> reordered(order.size());
+			for (size_t i = 0; i < order.size(); ++i)
+			{
+				reordered[i] = (*stream)[order[i]];
+			}
+			stream->swap(reordered);
+		}
+	}
+
+	TRDrawableMesh::TRDrawableMesh(const std::string &filename, bool optimizeVertexCache)
+	{
+		loadMeshFromFile(filename, optimizeVertexCache);
 	}
 
 	void TRDrawableMesh::clear()
 	{
 		m_vertices_attrib.clear();
 		std::vector<TRMeshFace>().swap(m_mesh_faces);
+		std::vector<TRMaterial>().swap(m_materials);
+		std::vector<TRSubMesh>().swap(m_submeshes);
+		std::vector<TRMeshCluster>().swap(m_clusters);
+		m_aabb_min = m_aabb_max = glm::vec3(0.0f);
+		m_bounding_sphere = glm::vec4(0.0f);
 	}
 
 	TRDrawableMesh& TRDrawableMesh::operator=(const TRDrawableMesh& mesh)
@@ -29,16 +54,26 @@ namespace TinyRenderer
 			return *this;
 		m_vertices_attrib = mesh.m_vertices_attrib;
 		m_mesh_faces = mesh.m_mesh_faces;
+		m_materials = mesh.m_materials;
+		m_submeshes = mesh.m_submeshes;
+		m_clusters = mesh.m_clusters;
+		m_instance_transforms = mesh.m_instance_transforms;
+		m_instance_tints = mesh.m_instance_tints;
+		m_aabb_min = mesh.m_aabb_min;
+		m_aabb_max = mesh.m_aabb_max;
+		m_bounding_sphere = mesh.m_bounding_sphere;
+		updateSceneIndex();
 		return *this;
 	}
 
-	void TRDrawableMesh::loadMeshFromFile(const std::string &filename)
+	void TRDrawableMesh::loadMeshFromFile(const std::string &filename, bool optimizeVertexCache)
 	{
 		clear();
 
 		//Refs: https://github.com/tinyobjloader/tinyobjloader
 
 		tinyobj::ObjReaderConfig reader_config;
+		reader_config.vertex_color = false;
 
 		tinyobj::ObjReader reader;
 
@@ -148,25 +183,76 @@ namespace TinyRenderer
 
 		}
 
+		//Material table
+		for (size_t m = 0; m < materials.size(); ++m)
+		{
+			const tinyobj::material_t* mp = &materials[m];
+			TRMaterial material;
+			material.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
+			material.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
+			material.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
+			material.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
+			material.shininess = mp->shininess;
+			material.diffuseMapTexId = matTextureIds[m].x;
+			material.specularMapTexId = matTextureIds[m].y;
+			material.normalMapTexId = matTextureIds[m].z;
+			material.glowMapTexId = matTextureIds[m].w;
+			m_materials.push_back(material);
+		}
+		//The faces without a valid material use the default one
+		//Note: the material id of a face is 16 bits wide.
+		const unsigned int defaultMaterialId = static_cast<unsigned int>(m_materials.size());
+		if (defaultMaterialId > std::numeric_limits<unsigned short>::max())
+		{
+			std::cerr << "TRDrawableMesh: " << materials.size() << " materials, at most "
+				<< std::numeric_limits<unsigned short>::max() << " are supported\n";
+			exit(1);
+		}
+
 		//Geometry loading
+		//Note: the obj file indexes the positions, normals and texcoords separately, each unique
+		//      combination of them is welded to one vertex of the indexed vertex buffer.
 		{
-			for (size_t i = 0; i < attrib.vertices.size(); i += 3)
-			{
-				m_vertices_attrib.vpositions.push_back(
-					glm::vec4(attrib.vertices[i + 0], attrib.vertices[i + 1], attrib.vertices[i + 2], 1.0f));
-				m_vertices_attrib.vcolors.push_back(
-					glm::vec4(attrib.colors[i + 0], attrib.colors[i + 1], attrib.colors[i + 2], 1.0f));
-			}
-			for (size_t i = 0; i < attrib.normals.size(); i += 3)
+			std::map<std::tuple<int, int, int>, unsigned int> vertexDict;
+			auto weldVertex = [&](const tinyobj::index_t &idx) -> unsigned int
 			{
-				m_vertices_attrib.vnormals.push_back(
-					glm::vec3(attrib.normals[i + 0], attrib.normals[i + 1], attrib.normals[i + 2]));
-			}
-			for (size_t i = 0; i < attrib.texcoords.size(); i += 2)
-			{
-				m_vertices_attrib.vtexcoords.push_back(
-					glm::vec2(attrib.texcoords[i + 0], attrib.texcoords[i + 1]));
-			}
+				auto key = std::make_tuple(idx.vertex_index, idx.normal_index, idx.texcoord_index);
+				auto iter = vertexDict.find(key);
+				if (iter != vertexDict.end())
+				{
+					//Already welded
+					return iter->second;
+				}
+
+				const size_t p = 3 * idx.vertex_index;
+				m_vertices_attrib.vx.push_back(attrib.vertices[p + 0]);
+				m_vertices_attrib.vy.push_back(attrib.vertices[p + 1]);
+				m_vertices_attrib.vz.push_back(attrib.vertices[p + 2]);
+				if (!attrib.colors.empty())
+				{
+					m_vertices_attrib.vr.push_back(attrib.colors[p + 0]);
+					m_vertices_attrib.vg.push_back(attrib.colors[p + 1]);
+					m_vertices_attrib.vb.push_back(attrib.colors[p + 2]);
+				}
+				if (!attrib.normals.empty())
+				{
+					const size_t n = 3 * idx.normal_index;
+					m_vertices_attrib.vnx.push_back(idx.normal_index >= 0 ? attrib.normals[n + 0] : 0.0f);
+					m_vertices_attrib.vny.push_back(idx.normal_index >= 0 ? attrib.normals[n + 1] : 0.0f);
+					m_vertices_attrib.vnz.push_back(idx.normal_index >= 0 ? attrib.normals[n + 2] : 0.0f);
+				}
+				if (!attrib.texcoords.empty())
+				{
+					const size_t t = 2 * idx.texcoord_index;
+					m_vertices_attrib.vu.push_back(idx.texcoord_index >= 0 ? attrib.texcoords[t + 0] : 0.0f);
+					m_vertices_attrib.vv.push_back(idx.texcoord_index >= 0 ? attrib.texcoords[t + 1] : 0.0f);
+				}
+
+				unsigned int index = static_cast<unsigned int>(m_vertices_attrib.size() - 1);
+				vertexDict.insert({ key, index });
+				return index;
+			};
+
 			for (size_t s = 0; s < shapes.size(); ++s)
 			{
 				size_t index_offset = 0;
@@ -176,64 +262,437 @@ namespace TinyRenderer
 					TRMeshFace face;
 					for (size_t v = 0; v < fv && v < 3; ++v)
 					{
-						tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-						face.vposIndex[v] = idx.vertex_index;
-						face.vnorIndex[v] = idx.normal_index;
-						face.vtexIndex[v] = idx.texcoord_index;
+						face.vertexIndex[v] = weldVertex(shapes[s].mesh.indices[index_offset + v]);
 					}
 					//Material
 					{
-						if (shapes[s].mesh.material_ids[f] < materials.size())
+						int materialId = shapes[s].mesh.material_ids[f];
+						face.materialId = static_cast<unsigned short>((materialId >= 0 && materialId < static_cast<int>(materials.size())) ?
+							static_cast<unsigned int>(materialId) : defaultMaterialId);
+						if (face.materialId == defaultMaterialId && m_materials.size() == defaultMaterialId)
 						{
-							const tinyobj::material_t* mp = &materials[shapes[s].mesh.material_ids[f]];
-							face.kA = glm::vec3(mp->ambient[0], mp->ambient[1], mp->ambient[2]);
-							face.kD = glm::vec3(mp->diffuse[0], mp->diffuse[1], mp->diffuse[2]);
-							face.kS = glm::vec3(mp->specular[0], mp->specular[1], mp->specular[2]);
-							face.kE = glm::vec3(mp->emission[0], mp->emission[1], mp->emission[2]);
-							face.shininess = mp->shininess;
-							face.diffuseMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].x;
-							face.specularMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].y;
-							face.normalMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].z;
-							face.glowMapTexId = matTextureIds[shapes[s].mesh.material_ids[f]].w;
+							m_materials.push_back(TRMaterial());
 						}
 					}
 
-					//TBN matrix calculation for normal mapping
-					//Refs: https://learnopengl.com/Advanced-Lighting/Normal-Mapping
-					{
-						
-						glm::vec3 edge1 = glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[1]]) 
-							- glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[0]]);
-						glm::vec3 edge2 = glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[2]])
-							- glm::vec3(m_vertices_attrib.vpositions[face.vposIndex[0]]);
-
-						glm::vec2 deltaUV1 = glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[1]])
-							- glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[0]]);
-						glm::vec2 deltaUV2 = glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[2]])
-							- glm::vec2(m_vertices_attrib.vtexcoords[face.vtexIndex[0]]);
-
-						float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-
-						glm::vec3 tangent;
-						tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-						tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-						tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-
-						glm::vec3 bitangent;
-						bitangent.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
-						bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
-						bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
-
-						face.tangent = glm::normalize(tangent);
-						face.bitangent = glm::normalize(bitangent);
-					}
-
 					m_mesh_faces.push_back(face);
 					index_offset += fv;
 				}
 			}
 		}
+
+		//Group the faces by material
+		buildSubMeshes();
+
+		//Reorder the faces and vertices for the vertex cache
+		if (optimizeVertexCache)
+		{
+			optimizeVertexCacheLocality();
+		}
+
+		//Clusters for depth sorting, after the faces got their final order
+		buildClusters();
+
+		calcBoundingVolumes();
+		updateSceneIndex();
 		
 	}
 
-}
\ No newline at end of file
+	float TRDrawableMesh::calcACMR(const std::vector<unsigned int> &indices, size_t numVertices, int cacheSize)
+	{
+		if (indices.size() < 3)
+			return 0.0f;
+
+		//Simulate an LRU cache, the stamp of a vertex is the time of its last use
+		std::vector<size_t> stamps(numVertices, 0);
+		std::vector<unsigned int> cache;
+		size_t numMisses = 0;
+		for (size_t i = 0; i < indices.size(); ++i)
+		{
+			auto iter = std::find(cache.begin(), cache.end(), indices[i]);
+			if (iter == cache.end())
+			{
+				++numMisses;
+				if (cache.size() < static_cast<size_t>(cacheSize))
+				{
+					cache.push_back(indices[i]);
+				}
+				else
+				{
+					//Evict the least recently used one
+					iter = std::min_element(cache.begin(), cache.end(),
+						[&](unsigned int a, unsigned int b) { return stamps[a] < stamps[b]; });
+					*iter = indices[i];
+				}
+			}
+			stamps[indices[i]] = i + 1;
+		}
+		return static_cast<float>(numMisses) / (indices.size() / 3);
+	}
+
+	std::vector<unsigned int> TRDrawableMesh::calcForsythFaceOrder(const std::vector<unsigned int> &indices, size_t numVertices)
+	{
+		constexpr int cacheSize = 32;
+		constexpr float cacheDecayPower = 1.5f;
+		constexpr float lastTriScore = 0.75f;
+		constexpr float valenceBoostScale = 2.0f;
+		constexpr float valenceBoostPower = 0.5f;
+
+		auto vertexScore = [&](int cachePos, int numActiveFaces) -> float
+		{
+			//No face needs this vertex anymore
+			if (numActiveFaces == 0)
+				return -1.0f;
+
+			float score = 0.0f;
+			if (cachePos >= 0)
+			{
+				//The vertices of the last face get a fixed score, so the order doesn't depend on the winding
+				if (cachePos < 3)
+				{
+					score = lastTriScore;
+				}
+				else
+				{
+					const float scaler = 1.0f / (cacheSize - 3);
+					score = std::pow(1.0f - (cachePos - 3) * scaler, cacheDecayPower);
+				}
+			}
+
+			//Boost the vertices with few faces left, so that the lone ones are cleared up early
+			score += valenceBoostScale * std::pow(static_cast<float>(numActiveFaces), -valenceBoostPower);
+			return score;
+		};
+
+		const size_t numFaces = indices.size() / 3;
+
+		//Vertex -> faces adjacency
+		std::vector<int> numActiveFaces(numVertices, 0);
+		for (size_t i = 0; i < numFaces * 3; ++i)
+		{
+			++numActiveFaces[indices[i]];
+		}
+		std::vector<size_t> adjacencyOffsets(numVertices + 1, 0);
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			adjacencyOffsets[v + 1] = adjacencyOffsets[v] + numActiveFaces[v];
+		}
+		std::vector<unsigned int> adjacency(adjacencyOffsets[numVertices]);
+		{
+			std::vector<size_t> cursors(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+			for (size_t i = 0; i < numFaces * 3; ++i)
+			{
+				adjacency[cursors[indices[i]]++] = static_cast<unsigned int>(i / 3);
+			}
+		}
+
+		std::vector<int> cachePositions(numVertices, -1);
+		std::vector<float> vertexScores(numVertices);
+		for (size_t v = 0; v < numVertices; ++v)
+		{
+			vertexScores[v] = vertexScore(-1, numActiveFaces[v]);
+		}
+		std::vector<float> faceScores(numFaces);
+		std::vector<bool> faceAdded(numFaces, false);
+		for (size_t f = 0; f < numFaces; ++f)
+		{
+			faceScores[f] = vertexScores[indices[3 * f + 0]] + vertexScores[indices[3 * f + 1]] + vertexScores[indices[3 * f + 2]];
+		}
+
+		std::vector<unsigned int> faceOrder;
+		faceOrder.reserve(numFaces);
+		std::vector<unsigned int> cache, newCache;
+		cache.reserve(cacheSize + 3);
+		newCache.reserve(cacheSize + 3);
+		int bestFace = -1;
+		size_t scanCursor = 0;
+		while (faceOrder.size() < numFaces)
+		{
+			//No candidate around the cache, pick the next remaining face
+			if (bestFace < 0)
+			{
+				while (faceAdded[scanCursor])
+				{
+					++scanCursor;
+				}
+				bestFace = static_cast<int>(scanCursor);
+			}
+
+			//Emit the face
+			faceAdded[bestFace] = true;
+			faceOrder.push_back(bestFace);
+
+			//Its vertices go to the front of the cache
+			newCache.clear();
+			for (int k = 0; k < 3; ++k)
+			{
+				const unsigned int v = indices[3 * bestFace + k];
+				newCache.push_back(v);
+
+				//Remove the face from the active list of the vertex
+				auto begin = adjacency.begin() + adjacencyOffsets[v];
+				auto end = begin + numActiveFaces[v];
+				std::iter_swap(std::find(begin, end, static_cast<unsigned int>(bestFace)), end - 1);
+				--numActiveFaces[v];
+			}
+			for (unsigned int v : cache)
+			{
+				if (std::find(newCache.begin(), newCache.begin() + 3, v) == newCache.begin() + 3)
+				{
+					newCache.push_back(v);
+				}
+			}
+
+			//Rescore the vertices in the cache (and the evicted ones) and their remaining faces
+			for (size_t i = 0; i < newCache.size(); ++i)
+			{
+				const unsigned int v = newCache[i];
+				cachePositions[v] = (i < cacheSize) ? static_cast<int>(i) : -1;
+				vertexScores[v] = vertexScore(cachePositions[v], numActiveFaces[v]);
+			}
+			bestFace = -1;
+			float bestScore = -1.0f;
+			for (unsigned int v : newCache)
+			{
+				for (int a = 0; a < numActiveFaces[v]; ++a)
+				{
+					const unsigned int f = adjacency[adjacencyOffsets[v] + a];
+					faceScores[f] = vertexScores[indices[3 * f + 0]] + vertexScores[indices[3 * f + 1]] + vertexScores[indices[3 * f + 2]];
+					if (faceScores[f] > bestScore)
+					{
+						bestScore = faceScores[f];
+						bestFace = static_cast<int>(f);
+					}
+				}
+			}
+
+			if (newCache.size() > cacheSize)
+			{
+				newCache.resize(cacheSize);
+			}
+			std::swap(cache, newCache);
+		}
+
+		return faceOrder;
+	}
+
+	void TRDrawableMesh::optimizeVertexCacheLocality()
+	{
+		const size_t numVertices = m_vertices_attrib.size();
+
+		//Flat index list of faces [first, first + count)
+		auto gatherIndices = [&](size_t first, size_t count) -> std::vector<unsigned int>
+		{
+			std::vector<unsigned int> indices;
+			indices.reserve(3 * count);
+			for (size_t f = first; f < first + count; ++f)
+			{
+				indices.insert(indices.end(), m_mesh_faces[f].vertexIndex, m_mesh_faces[f].vertexIndex + 3);
+			}
+			return indices;
+		};
+		const float acmrBefore = calcACMR(gatherIndices(0, m_mesh_faces.size()), numVertices);
+
+		//Face reordering inside each submesh
+		for (const auto &submesh : m_submeshes)
+		{
+			std::vector<unsigned int> faceOrder = calcForsythFaceOrder(gatherIndices(submesh.firstFace, submesh.numFaces), numVertices);
+			std::vector<TRMeshFace> faces(m_mesh_faces.begin() + submesh.firstFace,
+				m_mesh_faces.begin() + submesh.firstFace + submesh.numFaces);
+			for (size_t f = 0; f < faceOrder.size(); ++f)
+			{
+				m_mesh_faces[submesh.firstFace + f] = faces[faceOrder[f]];
+			}
+		}
+
+		//Vertex fetch reordering: the vertices are stored in the order of their first use
+		{
+			std::vector<int> remap(numVertices, -1);
+			std::vector<unsigned int> order;
+			order.reserve(numVertices);
+			for (auto &face : m_mesh_faces)
+			{
+				for (auto &index : face.vertexIndex)
+				{
+					if (remap[index] < 0)
+					{
+						remap[index] = static_cast<int>(order.size());
+						order.push_back(index);
+					}
+					index = remap[index];
+				}
+			}
+			m_vertices_attrib.reorder(order);
+		}
+
+		const float acmrAfter = calcACMR(gatherIndices(0, m_mesh_faces.size()), m_vertices_attrib.size());
+		std::cout << "Vertex cache optimization: " << m_mesh_faces.size() << " faces, ACMR "
+			<< acmrBefore << " -> " << acmrAfter << std::endl;
+	}
+
+	void TRDrawableMesh::setModelMatrix(const glm::mat4& mat)
+	{
+		m_drawing_config.modelMatrix = mat;
+		updateSceneIndex();
+	}
+
+	void TRDrawableMesh::setInstances(const std::vector<glm::mat4> &transforms, const std::vector<glm::vec3> &tints)
+	{
+		if (!tints.empty() && tints.size() != transforms.size())
+		{
+			std::cerr << "TRDrawableMesh: " << tints.size() << " tints for " << transforms.size() << " instances\n";
+			return;
+		}
+		m_instance_transforms = transforms;
+		m_instance_tints = tints;
+		updateSceneIndex();
+	}
+
+	void TRDrawableMesh::getWorldAABB(glm::vec3 &bmin, glm::vec3 &bmax) const
+	{
+		//Refs: Arvo J. Transforming axis-aligned bounding boxes. Graphics Gems, 1990.
+		bmin = glm::vec3(std::numeric_limits<float>::max());
+		bmax = glm::vec3(-std::numeric_limits<float>::max());
+		for (size_t i = 0; i < getInstanceCount(); ++i)
+		{
+			const glm::mat4 model = getInstanceModelMatrix(i);
+			glm::vec3 inst_min = glm::vec3(model[3]);
+			glm::vec3 inst_max = glm::vec3(model[3]);
+			for (int j = 0; j < 3; ++j)
+			{
+				glm::vec3 a = glm::vec3(model[j]) * m_aabb_min[j];
+				glm::vec3 b = glm::vec3(model[j]) * m_aabb_max[j];
+				inst_min += glm::min(a, b);
+				inst_max += glm::max(a, b);
+			}
+			bmin = glm::min(bmin, inst_min);
+			bmax = glm::max(bmax, inst_max);
+		}
+	}
+
+	void TRDrawableMesh::updateSceneIndex()
+	{
+		if (m_scene_bvh == nullptr)
+			return;
+		glm::vec3 bmin, bmax;
+		getWorldAABB(bmin, bmax);
+		m_scene_bvh->moveProxy(m_scene_proxy, bmin, bmax);
+	}
+
+	void TRDrawableMesh::buildSubMeshes()
+	{
+		//Stable, so the faces keep their order inside a submesh
+		std::vector<unsigned int> faceOrder(m_mesh_faces.size());
+		for (size_t f = 0; f < faceOrder.size(); ++f)
+		{
+			faceOrder[f] = static_cast<unsigned int>(f);
+		}
+		std::stable_sort(faceOrder.begin(), faceOrder.end(),
+			[&](unsigned int a, unsigned int b) { return m_mesh_faces[a].materialId < m_mesh_faces[b].materialId; });
+
+		std::vector<TRMeshFace> faces(m_mesh_faces.size());
+		for (size_t f = 0; f < faceOrder.size(); ++f)
+		{
+			faces[f] = m_mesh_faces[faceOrder[f]];
+
+			//A new submesh starts where the material changes
+			const unsigned int materialId = faces[f].materialId;
+			if (m_submeshes.empty() || m_submeshes.back().materialId != materialId)
+			{
+				TRSubMesh submesh;
+				submesh.firstFace = static_cast<unsigned int>(f);
+				submesh.materialId = materialId;
+				m_submeshes.push_back(submesh);
+			}
+			++m_submeshes.back().numFaces;
+		}
+		m_mesh_faces.swap(faces);
+	}
+
+	void TRDrawableMesh::buildClusters()
+	{
+		//AABB of the faces [first, first + count)
+		auto calcAABB = [&](size_t first, size_t count, glm::vec3 &bmin, glm::vec3 &bmax)
+		{
+			bmin = glm::vec3(std::numeric_limits<float>::max());
+			bmax = glm::vec3(-std::numeric_limits<float>::max());
+			for (size_t f = first; f < first + count; ++f)
+			{
+				for (unsigned int index : m_mesh_faces[f].vertexIndex)
+				{
+					glm::vec3 pos = glm::vec3(m_vertices_attrib.position(index));
+					bmin = glm::min(bmin, pos);
+					bmax = glm::max(bmax, pos);
+				}
+			}
+		};
+
+		for (auto &submesh : m_submeshes)
+		{
+			calcAABB(submesh.firstFace, submesh.numFaces, submesh.bmin, submesh.bmax);
+			submesh.firstCluster = static_cast<unsigned int>(m_clusters.size());
+			for (unsigned int f = 0; f < submesh.numFaces; f += m_cluster_size)
+			{
+				TRMeshCluster cluster;
+				cluster.firstFace = submesh.firstFace + f;
+				cluster.numFaces = std::min(m_cluster_size, submesh.numFaces - f);
+				calcAABB(cluster.firstFace, cluster.numFaces, cluster.bmin, cluster.bmax);
+				m_clusters.push_back(cluster);
+			}
+			submesh.numClusters = static_cast<unsigned int>(m_clusters.size()) - submesh.firstCluster;
+		}
+	}
+
+	void TRDrawableMesh::calcFaceTangentSpace(const TRMeshFace &face, glm::vec3 &tangent, glm::vec3 &bitangent) const
+	{
+		//TBN matrix calculation for normal mapping
+		//Refs: https://learnopengl.com/Advanced-Lighting/Normal-Mapping
+		const unsigned int *vertIndex = face.vertexIndex;
+		glm::vec3 edge1 = glm::vec3(m_vertices_attrib.position(vertIndex[1]))
+			- glm::vec3(m_vertices_attrib.position(vertIndex[0]));
+		glm::vec3 edge2 = glm::vec3(m_vertices_attrib.position(vertIndex[2]))
+			- glm::vec3(m_vertices_attrib.position(vertIndex[0]));
+
+		glm::vec2 deltaUV1 = m_vertices_attrib.texcoord(vertIndex[1]) - m_vertices_attrib.texcoord(vertIndex[0]);
+		glm::vec2 deltaUV2 = m_vertices_attrib.texcoord(vertIndex[2]) - m_vertices_attrib.texcoord(vertIndex[0]);
+
+		float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
+
+		tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
+		tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
+		tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
+
+		bitangent.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
+		bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
+		bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
+
+		tangent = glm::normalize(tangent);
+		bitangent = glm::normalize(bitangent);
+	}
+
+	void TRDrawableMesh::calcBoundingVolumes()
+	{
+		const size_t numVertices = m_vertices_attrib.size();
+		if (numVertices == 0)
+			return;
+
+		m_aabb_min = m_aabb_max = glm::vec3(m_vertices_attrib.position(0));
+		for (size_t i = 1; i < numVertices; ++i)
+		{
+			glm::vec3 pos = glm::vec3(m_vertices_attrib.position(i));
+			m_aabb_min = glm::min(m_aabb_min, pos);
+			m_aabb_max = glm::max(m_aabb_max, pos);
+		}
+
+		//Sphere around the center of the AABB
+		glm::vec3 center = (m_aabb_min + m_aabb_max) * 0.5f;
+		float radius2 = 0.0f;
+		for (size_t i = 0; i < numVertices; ++i)
+		{
+			glm::vec3 offset = glm::vec3(m_vertices_attrib.position(i)) - center;
+			radius2 = std::max(radius2, glm::dot(offset, offset));
+		}
+		m_bounding_sphere = glm::vec4(center, std::sqrt(radius2));
+	}
+
+}
@@ -8,35 +8,52 @@
 #include "glm/glm.hpp"
 
 #include "TRShadingState.h"
+#include "TRSimd.h"
+#include "TRSceneBVH.h"
 
 namespace TinyRenderer
 {
+	//Unique vertices in structure-of-arrays layout, all the streams are indexed by the same vertex index
+	//Note: the color, normal and texcoord streams are optional, they are empty if the source mesh has none.
 	class TRVertexAttrib final
 	{
 	public:
-		std::vector<glm::vec4> vpositions;
-		std::vector<glm::vec4> vcolors;
-		std::vector<glm::vec2> vtexcoords;
-		std::vector<glm::vec3> vnormals;
+		//Position (w is always 1)
+		TRAlignedVector<float> vx, vy, vz;
+		//Optional color
+		TRAlignedVector<float> vr, vg, vb;
+		//Optional normal
+		TRAlignedVector<float> vnx, vny, vnz;
+		//Optional texcoord
+		TRAlignedVector<float> vu, vv;
+
+		size_t size() const { return vx.size(); }
+		bool hasColors() const { return !vr.empty(); }
+		bool hasNormals() const { return !vnx.empty(); }
+		bool hasTexcoords() const { return !vu.empty(); }
+
+		//Attributes of one vertex, an absent stream gives the default value
+		glm::vec4 position(size_t i) const { return glm::vec4(vx[i], vy[i], vz[i], 1.0f); }
+		glm::vec3 color(size_t i) const { return hasColors() ? glm::vec3(vr[i], vg[i], vb[i]) : glm::vec3(1.0f); }
+		glm::vec3 normal(size_t i) const { return hasNormals() ? glm::vec3(vnx[i], vny[i], vnz[i]) : glm::vec3(0.0f); }
+		glm::vec2 texcoord(size_t i) const { return hasTexcoords() ? glm::vec2(vu[i], vv[i]) : glm::vec2(0.0f); }
+
+		//Gather the vertices in the given order, i.e., the new i-th vertex is the old order[i]-th one
+		void reorder(const std::vector<unsigned int> &order);
 
 		void clear()
 		{
-			std::vector<glm::vec4>().swap(vpositions);
-			std::vector<glm::vec4>().swap(vcolors);
-			std::vector<glm::vec2>().swap(vtexcoords);
-			std::vector<glm::vec3>().swap(vnormals);
-
+			for (auto stream : { &vx, &vy, &vz, &vr, &vg, &vb, &vnx, &vny, &vnz, &vu, &vv })
+			{
+				TRAlignedVector<float>().swap(*stream);
+			}
 		}
 	};
 
-	class TRMeshFace final
+	//Material shared by the faces of a submesh
+	class TRMaterial final
 	{
 	public:
-		unsigned int vposIndex[3];
-		unsigned int vnorIndex[3];
-		unsigned int vtexIndex[3];
-
-		//Per face material
 		int diffuseMapTexId = -1;
 		int specularMapTexId = -1;
 		int normalMapTexId = -1;
@@ -46,10 +63,38 @@ namespace TinyRenderer
 		glm::vec3 kS = glm::vec3(0.0f);//Specular coefficient
 		glm::vec3 kE = glm::vec3(0.0f);//Emission
 		float shininess = 1.0f;		   //Specular highlight exponment
+	};
 
-		//TBN matrix
-		glm::vec3 tangent;
-		glm::vec3 bitangent;
+	//Compact face record, the faces are the index buffer of the mesh
+	//Note: the shading parameters live in the material table, the tangent frame is computed
+	//      on demand (see TRDrawableMesh::calcFaceTangentSpace).
+	class TRMeshFace final
+	{
+	public:
+		unsigned int vertexIndex[3];
+		unsigned short materialId;
+	};
+
+	//Faces [firstFace, firstFace + numFaces) sharing the same material
+	//Note: the faces are split into clusters [firstCluster, firstCluster + numClusters) for coarse depth sorting.
+	class TRSubMesh final
+	{
+	public:
+		unsigned int firstFace = 0;
+		unsigned int numFaces = 0;
+		unsigned int materialId = 0;
+		unsigned int firstCluster = 0;
+		unsigned int numClusters = 0;
+		glm::vec3 bmin = glm::vec3(0.0f), bmax = glm::vec3(0.0f);//Local space AABB
+	};
+
+	//Consecutive faces of a submesh, close to each other after the vertex cache optimization
+	class TRMeshCluster final
+	{
+	public:
+		unsigned int firstFace = 0;
+		unsigned int numFaces = 0;
+		glm::vec3 bmin = glm::vec3(0.0f), bmax = glm::vec3(0.0f);//Local space AABB
 	};
 
 	class TRDrawableMesh
@@ -61,17 +106,42 @@ namespace TinyRenderer
 		TRDrawableMesh() = default;
 		~TRDrawableMesh() = default;
 		
-		TRDrawableMesh(const std::string &filename);
+		TRDrawableMesh(const std::string &filename, bool optimizeVertexCache = false);
 		TRDrawableMesh(const TRDrawableMesh& mesh)
-			: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_faces(mesh.m_mesh_faces) {}
+			: m_vertices_attrib(mesh.m_vertices_attrib), m_mesh_faces(mesh.m_mesh_faces),
+			m_materials(mesh.m_materials), m_submeshes(mesh.m_submeshes), m_clusters(mesh.m_clusters),
+			m_instance_transforms(mesh.m_instance_transforms), m_instance_tints(mesh.m_instance_tints),
+			m_aabb_min(mesh.m_aabb_min), m_aabb_max(mesh.m_aabb_max), m_bounding_sphere(mesh.m_bounding_sphere) {}
 		TRDrawableMesh& operator=(const TRDrawableMesh& mesh);
 
-		void loadMeshFromFile(const std::string &filename);
+		//Note: optimizeVertexCache reorders the faces for post-transform vertex cache locality
+		//      and then the vertices in the order of their first use.
+		void loadMeshFromFile(const std::string &filename, bool optimizeVertexCache = false);
+
+		//Average cache miss ratio (shaded vertices per face) of an LRU post-transform vertex cache
+		static float calcACMR(const std::vector<unsigned int> &indices, size_t numVertices, int cacheSize = 32);
 
 		TRVertexAttrib& getVerticesAttrib() { return m_vertices_attrib; }
 		std::vector<TRMeshFace>& getMeshFaces() { return m_mesh_faces; }
 		const TRVertexAttrib& getVerticesAttrib() const { return m_vertices_attrib; }
 		const std::vector<TRMeshFace>& getMeshFaces() const { return m_mesh_faces; }
+		const std::vector<TRMaterial>& getMaterials() const { return m_materials; }
+		const std::vector<TRSubMesh>& getSubMeshes() const { return m_submeshes; }
+		const std::vector<TRMeshCluster>& getClusters() const { return m_clusters; }
+
+		//Tangent and bitangent of a face for normal mapping, from its positions and texcoords
+		void calcFaceTangentSpace(const TRMeshFace &face, glm::vec3 &tangent, glm::vec3 &bitangent) const;
+
+		//Local space bounding volumes, the sphere is (center, radius)
+		const glm::vec3& getAABBMin() const { return m_aabb_min; }
+		const glm::vec3& getAABBMax() const { return m_aabb_max; }
+		const glm::vec4& getBoundingSphere() const { return m_bounding_sphere; }
+		//World space AABB with the current model matrix (of all the instances)
+		void getWorldAABB(glm::vec3 &bmin, glm::vec3 &bmax) const;
+
+		//Scene index (see TRRenderer::addDrawableMesh), the leaf is moved as the model matrix changes
+		void attachSceneIndex(TRSceneBVH *bvh, int proxy) { m_scene_bvh = bvh; m_scene_proxy = proxy; }
+		void updateSceneIndex();
 
 		void clear();
 
@@ -80,7 +150,7 @@ namespace TinyRenderer
 		void setCullfaceMode(TRCullFaceMode mode) { m_drawing_config.cullfaceMode = mode; }
 		void setDepthtestMode(TRDepthTestMode mode) { m_drawing_config.depthtestMode = mode; }
 		void setDepthwriteMode(TRDepthWriteMode mode) { m_drawing_config.depthwriteMode = mode; }
-		void setModelMatrix(const glm::mat4& mat) { m_drawing_config.modelMatrix = mat; }
+		void setModelMatrix(const glm::mat4& mat);
 		void setLightingMode(TRLightingMode mode) { m_drawing_config.lightingMode = mode; }
 
 		TRPolygonMode getPolygonMode() const { return m_drawing_config.polygonMode; }
@@ -90,10 +160,51 @@ namespace TinyRenderer
 		const glm::mat4& getModelMatrix() const { return m_drawing_config.modelMatrix; }
 		TRLightingMode getLightingMode() const { return m_drawing_config.lightingMode; }
 
+		//Instanced drawing: the mesh is drawn once per instance with modelMatrix * transforms[i] as the model matrix
+		//Note: the tints modulate the fragment colors, they are optional (empty or one per instance).
+		//      Without instances the mesh is drawn once with the model matrix.
+		void setInstances(const std::vector<glm::mat4> &transforms, const std::vector<glm::vec3> &tints = {});
+		void clearInstances() { setInstances({}); }
+		size_t getInstanceCount() const { return m_instance_transforms.empty() ? 1 : m_instance_transforms.size(); }
+		glm::mat4 getInstanceModelMatrix(size_t i) const
+		{
+			return m_instance_transforms.empty() ? m_drawing_config.modelMatrix : m_drawing_config.modelMatrix * m_instance_transforms[i];
+		}
+		glm::vec3 getInstanceTint(size_t i) const { return m_instance_tints.empty() ? glm::vec3(1.0f) : m_instance_tints[i]; }
+
 	protected:
+		//Vertex cache optimization
+		//Refs: Forsyth T. Linear-speed vertex cache optimisation. https://tomforsyth1000.github.io/papers/fast_vert_cache_opt.html
+		void optimizeVertexCacheLocality();
+		static std::vector<unsigned int> calcForsythFaceOrder(const std::vector<unsigned int> &indices, size_t numVertices);
+
+		void buildSubMeshes();
+		void buildClusters();
+		void calcBoundingVolumes();
+
 		TRVertexAttrib m_vertices_attrib;
 		std::vector<TRMeshFace> m_mesh_faces;
 
+		//Material table and the faces sorted by material
+		std::vector<TRMaterial> m_materials;
+		std::vector<TRSubMesh> m_submeshes;
+		std::vector<TRMeshCluster> m_clusters;
+		static constexpr unsigned int m_cluster_size = 64;
+
+		//Per instance data
+		std::vector<glm::mat4> m_instance_transforms;
+		std::vector<glm::vec3> m_instance_tints;
+
+		//Bounding volumes
+		glm::vec3 m_aabb_min = glm::vec3(0.0f);
+		glm::vec3 m_aabb_max = glm::vec3(0.0f);
+		glm::vec4 m_bounding_sphere = glm::vec4(0.0f);
+
+		//Scene index the mesh is registered in
+		//Note: not copied with the mesh, a copy has to be registered on its own.
+		TRSceneBVH *m_scene_bvh = nullptr;
+		int m_scene_proxy = -1;
+
 		//Configuration
 		struct DrawableConfig
 		{
@@ -37,6 +37,69 @@ namespace TinyRenderer
 				m_colorBuffer[row * m_width * m_channel + col * m_channel + 3] = alpha;
 			}
 		}
+
+		std::fill(m_gbuffer_flags.begin(), m_gbuffer_flags.end(), 0);
+	}
+
+	unsigned int TRFrameBuffer::countCoveredPixels() const
+	{
+		return static_cast<unsigned int>(std::count_if(m_depthBuffer.begin(), m_depthBuffer.end(),
+			[](float depth) { return depth < 1.0f; }));
+	}
+
+	void TRFrameBuffer::enableGBuffer(bool enable)
+	{
+		const size_t num_pixels = enable ? m_width * m_height : 0;
+		m_gbuffer_position.assign(num_pixels, glm::vec3(0.0f));
+		m_gbuffer_normal.assign(num_pixels, glm::vec3(0.0f));
+		m_gbuffer_albedo.assign(num_pixels, glm::vec3(0.0f));
+		m_gbuffer_specular.assign(num_pixels, glm::vec4(0.0f));
+		m_gbuffer_emission.assign(num_pixels, glm::vec3(0.0f));
+		m_gbuffer_tint.assign(num_pixels, glm::vec3(0.0f));
+		m_gbuffer_flags.assign(num_pixels, 0);
+		if (!enable)
+		{
+			//Release the memory
+			m_gbuffer_position.shrink_to_fit();
+			m_gbuffer_normal.shrink_to_fit();
+			m_gbuffer_albedo.shrink_to_fit();
+			m_gbuffer_specular.shrink_to_fit();
+			m_gbuffer_emission.shrink_to_fit();
+			m_gbuffer_tint.shrink_to_fit();
+			m_gbuffer_flags.shrink_to_fit();
+		}
+	}
+
+	void TRFrameBuffer::writeGBuffer(const unsigned int &x, const unsigned int &y, const TRGBufferTexel &texel)
+	{
+		if (x >= m_width || y >= m_height)
+			return;
+		unsigned int index = y * m_width + x;
+		m_gbuffer_position[index] = texel.position;
+		m_gbuffer_normal[index] = texel.normal;
+		m_gbuffer_albedo[index] = texel.albedo;
+		m_gbuffer_specular[index] = glm::vec4(texel.specular, texel.shininess);
+		m_gbuffer_emission[index] = texel.emission;
+		m_gbuffer_tint[index] = texel.tint;
+		m_gbuffer_flags[index] = GBUFFER_COVERED | (texel.lit ? GBUFFER_LIT : 0);
+	}
+
+	bool TRFrameBuffer::readGBuffer(const unsigned int &x, const unsigned int &y, TRGBufferTexel &texel) const
+	{
+		if (x >= m_width || y >= m_height)
+			return false;
+		unsigned int index = y * m_width + x;
+		if ((m_gbuffer_flags[index] & GBUFFER_COVERED) == 0)
+			return false;
+		texel.position = m_gbuffer_position[index];
+		texel.normal = m_gbuffer_normal[index];
+		texel.albedo = m_gbuffer_albedo[index];
+		texel.specular = glm::vec3(m_gbuffer_specular[index]);
+		texel.shininess = m_gbuffer_specular[index].w;
+		texel.emission = m_gbuffer_emission[index];
+		texel.tint = m_gbuffer_tint[index];
+		texel.lit = (m_gbuffer_flags[index] & GBUFFER_LIT) != 0;
+		return true;
 	}
 
 	void TRFrameBuffer::writeDepth(const unsigned int &x, const unsigned int &y, const float &value)
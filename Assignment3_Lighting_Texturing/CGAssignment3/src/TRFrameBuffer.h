@@ -8,6 +8,20 @@
 
 namespace TinyRenderer
 {
+	//Surface attributes of a pixel for deferred shading
+	class TRGBufferTexel final
+	{
+	public:
+		glm::vec3 position; //World space position
+		glm::vec3 normal;   //World space normal (not normalized)
+		glm::vec3 albedo;   //Ambient and diffuse color
+		glm::vec3 specular; //Specular color
+		glm::vec3 emission; //Glow color
+		glm::vec3 tint;     //Modulates the lit color
+		float shininess;
+		bool lit;           //If lighting is disabled the color is the emission
+	};
+
 	/**
 	 * @projectName   TinyRenderer
 	 * @brief         Frame buffer class.
@@ -34,9 +48,29 @@ namespace TinyRenderer
 		void writeDepth(const unsigned int &x, const unsigned int &y, const float &value);
 		void writeColor(const unsigned int &x, const unsigned int &y, const glm::vec4 &color);
 
+		//Pixels with a depth written since the last clear
+		unsigned int countCoveredPixels() const;
+
+		//G-buffer attachments for deferred shading, allocated on demand
+		//Note: clear() marks every pixel as empty, readGBuffer returns false for an empty pixel.
+		void enableGBuffer(bool enable);
+		bool hasGBuffer() const { return !m_gbuffer_flags.empty(); }
+		void writeGBuffer(const unsigned int &x, const unsigned int &y, const TRGBufferTexel &texel);
+		bool readGBuffer(const unsigned int &x, const unsigned int &y, TRGBufferTexel &texel) const;
+
 	private:
 		std::vector<float> m_depthBuffer;          // Z-buffer
 		std::vector<unsigned char> m_colorBuffer;   // Color buffer
+
+		// G-buffer attachments
+		std::vector<glm::vec3> m_gbuffer_position;
+		std::vector<glm::vec3> m_gbuffer_normal;
+		std::vector<glm::vec3> m_gbuffer_albedo;
+		std::vector<glm::vec4> m_gbuffer_specular;  // Specular color and shininess
+		std::vector<glm::vec3> m_gbuffer_emission;
+		std::vector<glm::vec3> m_gbuffer_tint;
+		std::vector<unsigned char> m_gbuffer_flags; // GBUFFER_COVERED | GBUFFER_LIT
+		enum { GBUFFER_COVERED = 1, GBUFFER_LIT = 2 };
 		unsigned int m_width, m_height, m_channel;  // Viewport
 	};
 }
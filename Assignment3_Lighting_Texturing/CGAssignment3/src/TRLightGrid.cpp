@@ -0,0 +1,102 @@
+#include "TRLightGrid.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <functional>
+
+namespace TinyRenderer
+{
+	//Refs: Olsson O, Billeter M, Assarsson U. Clustered deferred and forward shading. HPG 2012.
+
+	constexpr int TRLightGrid::m_tile_size;
+	constexpr int TRLightGrid::m_num_slices;
+
+	void TRLightGrid::build(const std::vector<TRPointLight> &lights, float threshold, const glm::mat4 &view,
+		const glm::mat4 &project, float near, float far, int width, int height)
+	{
+		m_num_tiles_x = (width + m_tile_size - 1) / m_tile_size;
+		m_num_tiles_y = (height + m_tile_size - 1) / m_tile_size;
+		m_tile_scale_x = 0.5f * width / m_tile_size;
+		m_tile_scale_y = 0.5f * height / m_tile_size;
+		m_near = near;
+		m_slice_scale = m_num_slices / fastLog2(far / near);
+		m_view = view;
+		m_view_project = project * view;
+
+		//Clusters [min, max] (tile x, tile y, slice) reached by each light, empty if min > max
+		std::vector<glm::ivec3> range_min(lights.size(), glm::ivec3(0));
+		std::vector<glm::ivec3> range_max(lights.size(), glm::ivec3(-1));
+		m_attenuation_cutoffs.resize(lights.size());
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			const auto &light = lights[i];
+			const float radius = light.calcEffectiveRadius(threshold);
+			const float intensity = std::max(light.lightColor.x, std::max(light.lightColor.y, light.lightColor.z));
+			m_attenuation_cutoffs[i] = (intensity > 0.0f) ? threshold / intensity : 0.0f;
+			const float depth = calcViewDepth(light.lightPos);
+			if (radius <= 0.0f || depth + radius < near || depth - radius > far)
+				continue;
+
+			//Depth slices of the sphere
+			range_min[i] = glm::ivec3(0, 0, calcSlice(std::max(depth - radius, near)));
+			range_max[i] = glm::ivec3(m_num_tiles_x - 1, m_num_tiles_y - 1, calcSlice(depth + radius));
+
+			//Screen tiles of the projected view space AABB of the sphere
+			//Note: the whole screen if the sphere crosses the eye plane.
+			if (depth - radius > 0.0f)
+			{
+				const glm::vec3 center = glm::vec3(view * glm::vec4(light.lightPos, 1.0f));
+				glm::vec2 ndc_min(std::numeric_limits<float>::max());
+				glm::vec2 ndc_max(-std::numeric_limits<float>::max());
+				for (int c = 0; c < 8; ++c)
+				{
+					glm::vec3 corner = center + radius * glm::vec3((c & 1) ? 1.0f : -1.0f, (c & 2) ? 1.0f : -1.0f, (c & 4) ? 1.0f : -1.0f);
+					glm::vec4 clip = project * glm::vec4(corner, 1.0f);
+					glm::vec2 ndc = glm::vec2(clip) / clip.w;
+					ndc_min = glm::min(ndc_min, ndc);
+					ndc_max = glm::max(ndc_max, ndc);
+				}
+				//Note: the screen y axis points down
+				glm::ivec2 tile_min = calcTile(glm::vec2(ndc_min.x, ndc_max.y));
+				glm::ivec2 tile_max = calcTile(glm::vec2(ndc_max.x, ndc_min.y));
+				range_min[i].x = tile_min.x;
+				range_min[i].y = tile_min.y;
+				range_max[i].x = tile_max.x;
+				range_max[i].y = tile_max.y;
+			}
+		}
+
+		//Count the lights of each cluster, then fill the lists in the light order
+		const unsigned int num_clusters = getNumberOfClusters();
+		auto for_each_cluster = [&](size_t i, const std::function<void(unsigned int)> &func)
+		{
+			for (int s = range_min[i].z; s <= range_max[i].z; ++s)
+				for (int ty = range_min[i].y; ty <= range_max[i].y; ++ty)
+					for (int tx = range_min[i].x; tx <= range_max[i].x; ++tx)
+						func((s * m_num_tiles_y + ty) * m_num_tiles_x + tx);
+		};
+		m_cluster_offsets.assign(num_clusters + 1, 0);
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			for_each_cluster(i, [&](unsigned int cluster) { ++m_cluster_offsets[cluster + 1]; });
+		}
+		for (unsigned int c = 0; c < num_clusters; ++c)
+		{
+			m_cluster_offsets[c + 1] += m_cluster_offsets[c];
+		}
+		m_light_indices.resize(m_cluster_offsets[num_clusters]);
+		std::vector<unsigned int> cursors(m_cluster_offsets.begin(), m_cluster_offsets.end() - 1);
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			for_each_cluster(i, [&](unsigned int cluster) { m_light_indices[cursors[cluster]++] = static_cast<unsigned int>(i); });
+		}
+	}
+
+	void TRLightGrid::clear()
+	{
+		std::vector<unsigned int>().swap(m_cluster_offsets);
+		std::vector<unsigned int>().swap(m_light_indices);
+		std::vector<float>().swap(m_attenuation_cutoffs);
+	}
+}
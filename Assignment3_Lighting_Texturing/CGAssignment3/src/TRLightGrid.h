@@ -0,0 +1,113 @@
+#ifndef TRLIGHTGRID_H
+#define TRLIGHTGRID_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+#include "glm/glm.hpp"
+
+#include "TRShadingState.h"
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Clustered light culling. The view frustum is split into screen tiles and exponential
+	 *                depth slices, each cluster keeps the point lights whose effective range reaches it.
+	 *                Rebuilt every frame, read only while rendering.
+	 */
+	class TRLightGrid final
+	{
+	public:
+		typedef std::shared_ptr<TRLightGrid> ptr;
+
+		// ctor/dtor.
+		TRLightGrid() = default;
+		~TRLightGrid() = default;
+
+		//Bin the lights ignoring their contribution below the threshold
+		void build(const std::vector<TRPointLight> &lights, float threshold, const glm::mat4 &view,
+			const glm::mat4 &project, float near, float far, int width, int height);
+
+		//No culling, every light reaches everywhere
+		void clear();
+		bool isEnabled() const { return !m_cluster_offsets.empty(); }
+
+		//Lights of the cluster around the world space point, [begin, end) of the light indices
+		//Note: inlined since it runs for every shaded fragment, only the x, y and w rows are needed.
+		void lookup(const glm::vec3 &pos, const unsigned int *&begin, const unsigned int *&end) const
+		{
+			const glm::mat4 &m = m_view_project;
+			float x = m[0][0] * pos.x + m[1][0] * pos.y + m[2][0] * pos.z + m[3][0];
+			float y = m[0][1] * pos.x + m[1][1] * pos.y + m[2][1] * pos.z + m[3][1];
+			float w = m[0][3] * pos.x + m[1][3] * pos.y + m[2][3] * pos.z + m[3][3];
+			float inv_w = 1.0f / (w > 1e-6f ? w : 1e-6f);
+			int tx = calcTile(x * inv_w * m_tile_scale_x + m_tile_scale_x, m_num_tiles_x);
+			int ty = calcTile(m_tile_scale_y - y * inv_w * m_tile_scale_y, m_num_tiles_y);
+			unsigned int cluster = (calcSlice(calcViewDepth(pos)) * m_num_tiles_y + ty) * m_num_tiles_x + tx;
+			begin = m_light_indices.data() + m_cluster_offsets[cluster];
+			end = m_light_indices.data() + m_cluster_offsets[cluster + 1];
+		}
+
+		//Attenuation of the i-th light at its effective radius
+		//Note: the shaders subtract it from the attenuation, so that a light fades out to 0 at the radius
+		//      instead of being cut off at the cluster borders.
+		float getAttenuationCutoff(unsigned int i) const { return m_attenuation_cutoffs[i]; }
+
+		unsigned int getNumberOfClusters() const { return m_num_tiles_x * m_num_tiles_y * m_num_slices; }
+		unsigned int getNumberOfLightIndices() const { return static_cast<unsigned int>(m_light_indices.size()); }
+
+	private:
+		int calcSlice(float depth) const
+		{
+			//Exponential slices, i.e., the clusters are about as deep as they are wide
+			if (!(depth > m_near))
+				return 0;
+			float slice = fastLog2(depth / m_near) * m_slice_scale;
+			return slice < m_num_slices - 1 ? static_cast<int>(slice) : m_num_slices - 1;
+		}
+		//Tile coordinate in the tile units, clamped to the screen
+		static int calcTile(float coord, int numTiles)
+		{
+			return coord > 0.0f ? (coord < numTiles - 1 ? static_cast<int>(coord) : numTiles - 1) : 0;
+		}
+		//Same mapping as the viewport transformation
+		glm::ivec2 calcTile(const glm::vec2 &ndc) const
+		{
+			return glm::ivec2(calcTile(ndc.x * m_tile_scale_x + m_tile_scale_x, m_num_tiles_x),
+				calcTile(m_tile_scale_y - ndc.y * m_tile_scale_y, m_num_tiles_y));
+		}
+		//Piecewise linear log2 from the float bits, monotonic which is all the slicing needs
+		static float fastLog2(float x)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &x, sizeof(float));
+			return static_cast<float>(bits) * (1.0f / (1 << 23)) - 127.0f;
+		}
+		float calcViewDepth(const glm::vec3 &pos) const
+		{
+			return -(m_view[0][2] * pos.x + m_view[1][2] * pos.y + m_view[2][2] * pos.z + m_view[3][2]);
+		}
+
+	private:
+		static constexpr int m_tile_size = 32;
+		static constexpr int m_num_slices = 16;
+
+		int m_num_tiles_x = 0, m_num_tiles_y = 0;
+		float m_tile_scale_x = 0.0f;  //Half of the screen size in tiles
+		float m_tile_scale_y = 0.0f;
+		float m_near = 0.0f;
+		float m_slice_scale = 0.0f;   //Slices per log2 depth unit
+		glm::mat4 m_view = glm::mat4(1.0f);
+		glm::mat4 m_view_project = glm::mat4(1.0f);
+
+		//Light indices of the i-th cluster are [m_cluster_offsets[i], m_cluster_offsets[i + 1])
+		std::vector<unsigned int> m_cluster_offsets;
+		std::vector<unsigned int> m_light_indices;
+		std::vector<float> m_attenuation_cutoffs;
+	};
+}
+
+#endif
@@ -6,9 +6,14 @@
 #include "TRUtils.h"
 
 #include <cmath>
+#include <cassert>
+#include <limits>
+#include <algorithm>
 
 namespace TinyRenderer
 {
+	constexpr int TRRenderer::m_tile_size;
+	constexpr int TRRenderer::ClipPolygon::max_vertices;
 
 	TRRenderer::TRRenderer(int width, int height)
 		: m_backBuffer(nullptr), m_frontBuffer(nullptr)
@@ -19,25 +24,48 @@ namespace TinyRenderer
 
 		//Setup viewport matrix (ndc space -> screen space)
 		m_viewportMatrix = TRUtils::calcViewPortMatrix(width, height);
+
+		//Screen tiles for the tile-binned rendering
+		m_tile_cols = (width + m_tile_size - 1) / m_tile_size;
+		m_tile_rows = (height + m_tile_size - 1) / m_tile_size;
+		m_tile_bins.resize(m_tile_cols * m_tile_rows);
+	}
+
+	TRRenderer::~TRRenderer()
+	{
+		//The meshes may outlive the renderer
+		for (auto &mesh : m_drawableMeshes)
+		{
+			mesh->attachSceneIndex(nullptr, -1);
+		}
 	}
 
 	void TRRenderer::addDrawableMesh(TRDrawableMesh::ptr mesh)
 	{
+		glm::vec3 bmin, bmax;
+		mesh->getWorldAABB(bmin, bmax);
+		int proxy = m_scene_bvh.createProxy(bmin, bmax, static_cast<int>(m_drawableMeshes.size()));
+		mesh->attachSceneIndex(&m_scene_bvh, proxy);
 		m_drawableMeshes.push_back(mesh);
 	}
 
 	void TRRenderer::addDrawableMesh(const std::vector<TRDrawableMesh::ptr> &meshes)
 	{
-		m_drawableMeshes.insert(m_drawableMeshes.end(), meshes.begin(), meshes.end());
+		for (auto &mesh : meshes)
+		{
+			addDrawableMesh(mesh);
+		}
 	}
 
 	void TRRenderer::unloadDrawableMesh()
 	{
 		for (size_t i = 0; i < m_drawableMeshes.size(); ++i)
 		{
+			m_drawableMeshes[i]->attachSceneIndex(nullptr, -1);
 			m_drawableMeshes[i]->clear();
 		}
 		std::vector<TRDrawableMesh::ptr>().swap(m_drawableMeshes);
+		m_scene_bvh.clear();
 	}
 
 	void TRRenderer::setViewMatrix(const glm::mat4 &view)
@@ -109,6 +137,40 @@ namespace TinyRenderer
 	{
 		TRShadingPipeline::clearSpotLight();
 	}
+	void TRRenderer::setGuardBand(float extent)
+	{
+		//Keep the screen space coordinates small enough for the integer edge functions
+		constexpr float max_pixels = 8192.0f;
+		float max_extent = max_pixels / std::max(m_backBuffer->getWidth(), m_backBuffer->getHeight());
+		m_guard_band = std::max(1.0f, std::min(extent, max_extent));
+	}
+
+	void TRRenderer::setDeferredShading(bool enable)
+	{
+		//Both of the double buffers are rendered to
+		m_deferred_shading = enable;
+		m_backBuffer->enableGBuffer(enable);
+		m_frontBuffer->enableGBuffer(enable);
+	}
+
+	void TRRenderer::setThreadNum(int num)
+	{
+		m_thread_num = std::max(num, 1);
+	}
+
+	void TRRenderer::applyMaterial(TRShadingPipeline &shader, const TRMaterial &material)
+	{
+		shader.setAmbientCoef(material.kA);
+		shader.setDiffuseCoef(material.kD);
+		shader.setSpecularCoef(material.kS);
+		shader.setEmissionColor(material.kE);
+		shader.setDiffuseTexId(material.diffuseMapTexId);
+		shader.setSpecularTexId(material.specularMapTexId);
+		shader.setNormalTexId(material.normalMapTexId);
+		shader.setGlowTexId(material.glowMapTexId);
+		shader.setShininess(material.shininess);
+	}
+
 	void TRRenderer::renderAllDrawableMeshes()
 	{
 		if (m_shader_handler == nullptr)
@@ -120,106 +182,208 @@ namespace TinyRenderer
 		m_shader_handler->setModelMatrix(m_modelMatrix);
 		m_shader_handler->setViewProjectMatrix(m_projectMatrix * m_viewMatrix);
 
+		//Bin the point lights into the view frustum clusters
+		if (m_light_culling_threshold > 0.0f)
+		{
+			TRShadingPipeline::getLightGrid().build(TRShadingPipeline::getPointLights(), m_light_culling_threshold,
+				m_viewMatrix, m_projectMatrix, m_frustum_near_far.x, m_frustum_near_far.y,
+				m_backBuffer->getWidth(), m_backBuffer->getHeight());
+		}
+		else
+		{
+			TRShadingPipeline::getLightGrid().clear();
+		}
+
+		//Tile-binned rendering or not
+		const bool tile_binning = m_thread_num > 1;
+		const bool deferred = m_deferred_shading && m_shader_handler->hasDeferredPath();
+		if (tile_binning)
+		{
+			m_draw_states.clear();
+			m_binned_triangles.clear();
+			for (auto &bin : m_tile_bins)
+			{
+				bin.clear();
+			}
+		}
+		const glm::ivec4 screen_scissor(0, 0, m_backBuffer->getWidth() - 1, m_backBuffer->getHeight() - 1);
+
 		//Draw a mesh step by step
-		m_clip_cull_profile.m_num_cliped_triangles = 0;
-		m_clip_cull_profile.m_num_culled_triangles = 0;
-		std::vector<TRShadingPipeline::VertexData> rasterized_points;
-		rasterized_points.reserve(m_backBuffer->getWidth() * m_backBuffer->getHeight());
-		for (size_t m = 0; m < m_drawableMeshes.size(); ++m)
+		m_clip_cull_profile = Profile();
+		ClipPolygon clipped_polygon;
+
+		//Visible set from the scene index, in the order the meshes were added
+		m_visible_meshes.clear();
+		m_scene_bvh.queryFrustum(m_projectMatrix * m_viewMatrix, m_visible_meshes);
+		std::sort(m_visible_meshes.begin(), m_visible_meshes.end());
+		m_clip_cull_profile.m_num_culled_meshes = m_drawableMeshes.size() - m_visible_meshes.size();
+
+		//Instanced drawing: the geometry is shared, every instance has its own model matrix
+		m_draw_items.clear();
+		for (int m : m_visible_meshes)
 		{
-			//Configuration
-			TRPolygonMode polygonMode = m_drawableMeshes[m]->getPolygonMode();
-			TRCullFaceMode cullfaceMode = m_drawableMeshes[m]->getCullfaceMode();
-			TRDepthTestMode depthtestMode = m_drawableMeshes[m]->getDepthtestMode();
-			TRDepthWriteMode depthwriteMode = m_drawableMeshes[m]->getDepthwriteMode();
-			m_shader_handler->setModelMatrix(m_drawableMeshes[m]->getModelMatrix());
-			m_shader_handler->setLightingEnable(m_drawableMeshes[m]->getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE);
-
-			const auto& vertices = m_drawableMeshes[m]->getVerticesAttrib();
-			const auto& faces = m_drawableMeshes[m]->getMeshFaces();
-			for (size_t f = 0; f < faces.size(); ++f)
+			const size_t num_instances = m_drawableMeshes[m]->getInstanceCount();
+			for (size_t inst = 0; inst < num_instances; ++inst)
 			{
-				//Setup the shading options
+				//View frustum culling of each instance with the (tighter) bounding volumes of the mesh
+				const glm::mat4 model = m_drawableMeshes[m]->getInstanceModelMatrix(inst);
+				if (isOutsideFrustum(*m_drawableMeshes[m], m_projectMatrix * m_viewMatrix * model))
 				{
-					m_shader_handler->setAmbientCoef(faces[f].kA);
-					m_shader_handler->setDiffuseCoef(faces[f].kD);
-					m_shader_handler->setSpecularCoef(faces[f].kS);
-					m_shader_handler->setEmissionColor(faces[f].kE);
-					m_shader_handler->setDiffuseTexId(faces[f].diffuseMapTexId);
-					m_shader_handler->setSpecularTexId(faces[f].specularMapTexId);
-					m_shader_handler->setNormalTexId(faces[f].normalMapTexId);
-					m_shader_handler->setGlowTexId(faces[f].glowMapTexId);
-					m_shader_handler->setShininess(faces[f].shininess);
-					// printf("%f ", m_shader_handler->m_shininess);
-					m_shader_handler->setTangent(faces[f].tangent);
-					m_shader_handler->setBitangent(faces[f].bitangent);
+					++m_clip_cull_profile.m_num_culled_meshes;
+					continue;
 				}
-				
-				//A triangle as primitive
-				TRShadingPipeline::VertexData v[3];
+				//Note: the meshes without the depth test or the depth write rely on the submission order (e.g., overlays),
+				//      the infinite key keeps them in that order after the sorted ones.
+				const float depth = isDepthOrdered(*m_drawableMeshes[m]) ?
+					calcFarViewDepth(m_viewMatrix * model, m_drawableMeshes[m]->getAABBMin(), m_drawableMeshes[m]->getAABBMax()) :
+					std::numeric_limits<float>::infinity();
+				m_draw_items.push_back({ m, static_cast<unsigned int>(inst), depth });
+			}
+		}
+
+		//Front-to-back ordering of the mesh instances
+		//Note: stable, so the instances at the same depth keep the submission order.
+		const bool sort_front_to_back = m_draw_order != TRDrawOrderMode::TR_DRAW_ORDER_SUBMISSION;
+		const bool sort_clusters = m_draw_order == TRDrawOrderMode::TR_DRAW_ORDER_FRONT_TO_BACK_CLUSTER;
+		if (sort_front_to_back)
+		{
+			std::stable_sort(m_draw_items.begin(), m_draw_items.end(),
+				[](const DrawItem &a, const DrawItem &b) { return a.depth < b.depth; });
+		}
+
+		std::vector<std::pair<float, unsigned int>> submesh_order, cluster_order;
+		auto nearer = [](const std::pair<float, unsigned int> &a, const std::pair<float, unsigned int> &b) { return a.first < b.first; };
+		for (const auto &item : m_draw_items)
+		{
+			const TRDrawableMesh &mesh = *m_drawableMeshes[item.mesh];
+
+			//Configuration
+			TRPolygonMode polygonMode = mesh.getPolygonMode();
+			TRCullFaceMode cullfaceMode = mesh.getCullfaceMode();
+			TRDepthTestMode depthtestMode = mesh.getDepthtestMode();
+			TRDepthWriteMode depthwriteMode = mesh.getDepthwriteMode();
+			bool lightingEnable = mesh.getLightingMode() == TRLightingMode::TR_LIGHTING_ENABLE;
+
+			const auto& vertices = mesh.getVerticesAttrib();
+			const auto& faces = mesh.getMeshFaces();
+			const auto& materials = mesh.getMaterials();
+			const auto& submeshes = mesh.getSubMeshes();
+			const auto& clusters = mesh.getClusters();
+
+			const glm::mat4 model = mesh.getInstanceModelMatrix(item.instance);
+			const glm::mat4 model_view = m_viewMatrix * model;
+			const glm::vec3 tint = mesh.getInstanceTint(item.instance);
+
+			//Only the depth tested and written meshes are reordered inside
+			const bool sort_submeshes = sort_front_to_back && isDepthOrdered(mesh);
+			const bool sort_mesh_clusters = sort_clusters && isDepthOrdered(mesh);
+
+			m_shader_handler->setModelMatrix(model);
+			m_shader_handler->setLightingEnable(lightingEnable);
+
+			//Vertex shader of all the unique vertices
+			shadeMeshVertices(vertices);
+
+			//Submeshes in draw order, the key is the view space depth
+			submesh_order.clear();
+			for (size_t s = 0; s < submeshes.size(); ++s)
+			{
+				submesh_order.push_back({ sort_submeshes ? calcFarViewDepth(model_view, submeshes[s].bmin, submeshes[s].bmax) : 0.0f,
+					static_cast<unsigned int>(s) });
+			}
+			if (sort_submeshes)
+			{
+				std::stable_sort(submesh_order.begin(), submesh_order.end(), nearer);
+			}
+
+			for (const auto &s : submesh_order)
+			{
+				const TRSubMesh &submesh = submeshes[s.second];
+
+				//Setup the shading options once per submesh
+				const TRMaterial &material = materials[submesh.materialId];
+				applyMaterial(*m_shader_handler, material);
+				//Note: the TBN matrix is only needed (and set up) for normal mapping
+				const bool normalMapping = material.normalMapTexId != -1;
+
+				//Render state of this submesh, recorded for the tile workers
+				const DrawState state = { &material, polygonMode, depthtestMode, depthwriteMode, lightingEnable, tint, deferred,
+					m_shader_handler->getFragmentShaderVariant() };
+				if (tile_binning)
 				{
-					v[0].pos = vertices.vpositions[faces[f].vposIndex[0]];
-					v[0].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[0]]);
-					v[0].nor = vertices.vnormals[faces[f].vnorIndex[0]];
-					v[0].tex = vertices.vtexcoords[faces[f].vtexIndex[0]];
-
-					v[1].pos = vertices.vpositions[faces[f].vposIndex[1]];
-					v[1].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[1]]);
-					v[1].nor = vertices.vnormals[faces[f].vnorIndex[1]];
-					v[1].tex = vertices.vtexcoords[faces[f].vtexIndex[1]];
-
-					v[2].pos = vertices.vpositions[faces[f].vposIndex[2]];
-					v[2].col = glm::vec3(vertices.vcolors[faces[f].vposIndex[2]]);
-					v[2].nor = vertices.vnormals[faces[f].vnorIndex[2]];
-					v[2].tex = vertices.vtexcoords[faces[f].vtexIndex[2]];
+					m_draw_states.push_back(state);
 				}
 
-				//Vertex shader stage
-				std::vector<TRShadingPipeline::VertexData> clipped_vertices;
+				//Face ranges in draw order: the whole submesh or its clusters sorted front-to-back
+				cluster_order.clear();
+				if (sort_mesh_clusters)
 				{
-					//Vertex shader
+					for (unsigned int c = submesh.firstCluster; c < submesh.firstCluster + submesh.numClusters; ++c)
 					{
-						m_shader_handler->vertexShader(v[0]);
-						m_shader_handler->vertexShader(v[1]);
-						m_shader_handler->vertexShader(v[2]);
+						cluster_order.push_back({ calcFarViewDepth(model_view, clusters[c].bmin, clusters[c].bmax), c });
 					}
+					std::stable_sort(cluster_order.begin(), cluster_order.end(), nearer);
+				}
+				const size_t num_ranges = sort_mesh_clusters ? cluster_order.size() : 1;
 
-					//Homogeneous space cliping
+				for (size_t r = 0; r < num_ranges; ++r)
+				{
+					const size_t first_face = sort_mesh_clusters ? clusters[cluster_order[r].second].firstFace : submesh.firstFace;
+					const size_t num_faces = sort_mesh_clusters ? clusters[cluster_order[r].second].numFaces : submesh.numFaces;
+					for (size_t f = first_face; f < first_face + num_faces; ++f)
 					{
-						clipped_vertices = clipingSutherlandHodgeman(v[0], v[1], v[2]);
-						if (clipped_vertices.empty())
-						{
-							++m_clip_cull_profile.m_num_cliped_triangles;
-							continue;
-						}
-					}
+						//A triangle as primitive
+						TRShadingPipeline::VertexData v[3];
 
-					//Perspective division
-					for (auto &vert : clipped_vertices)
-					{
-						//From clip space -> ndc space
-						TRShadingPipeline::VertexData::prePerspCorrection(vert);
-						vert.cpos /= vert.cpos.w;
-					}
-				}
+						//Vertex shader stage
+						{
+							//Fetch the shaded vertices
+							{
+								v[0] = m_vertex_cache[faces[f].vertexIndex[0]];
+								v[1] = m_vertex_cache[faces[f].vertexIndex[1]];
+								v[2] = m_vertex_cache[faces[f].vertexIndex[2]];
+								if (normalMapping)
+								{
+									glm::vec3 tangent, bitangent;
+									mesh.calcFaceTangentSpace(faces[f], tangent, bitangent);
+									m_shader_handler->faceTangentSpace(v[0], v[1], v[2], tangent, bitangent);
+								}
+							}
 
-				int num_verts = clipped_vertices.size();
-				for (int i = 0; i < num_verts - 2; ++i)
-				{
-					//Triangle assembly
-					TRShadingPipeline::VertexData vert[3] = {
-							clipped_vertices[0],
-							clipped_vertices[i + 1],
-							clipped_vertices[i + 2] };
+							//Homogeneous space cliping
+							{
+								if (!clipingSutherlandHodgeman(v[0], v[1], v[2], clipped_polygon))
+								{
+									++m_clip_cull_profile.m_num_cliped_triangles;
+									continue;
+								}
+							}
 
+							//Perspective division
+							for (int i = 0; i < clipped_polygon.size; ++i)
+							{
+								//From clip space -> ndc space
+								auto &vert = clipped_polygon.vertices[i];
+								TRShadingPipeline::VertexData::prePerspCorrection(vert);
+								vert.cpos /= vert.cpos.w;
+							}
+						}
 
-					//Rasterization stage
-					{
-						//Transform to screen space & Rasterization
+						int num_verts = clipped_polygon.size;
+						for (int i = 0; i < num_verts - 2; ++i)
 						{
-							vert[0].spos = glm::ivec2(m_viewportMatrix * vert[0].cpos + glm::vec4(0.5f));
-							vert[1].spos = glm::ivec2(m_viewportMatrix * vert[1].cpos + glm::vec4(0.5f));
-							vert[2].spos = glm::ivec2(m_viewportMatrix * vert[2].cpos + glm::vec4(0.5f));
+							//Triangle assembly
+							TRShadingPipeline::VertexData vert[3] = {
+									clipped_polygon.vertices[0],
+									clipped_polygon.vertices[i + 1],
+									clipped_polygon.vertices[i + 2] };
+
+							//Transform to screen space
+							{
+								vert[0].spos = glm::ivec2(m_viewportMatrix * vert[0].cpos + glm::vec4(0.5f));
+								vert[1].spos = glm::ivec2(m_viewportMatrix * vert[1].cpos + glm::vec4(0.5f));
+								vert[2].spos = glm::ivec2(m_viewportMatrix * vert[2].cpos + glm::vec4(0.5f));
+							}
 
 							//Backface culling
 							if (isBackFacing(vert[0].spos, vert[1].spos, vert[2].spos, cullfaceMode))
@@ -228,49 +392,38 @@ namespace TinyRenderer
 								continue;
 							}
 
-							switch (polygonMode)
+							//Defer the rasterization to the tile workers
+							if (tile_binning)
 							{
-								case TRPolygonMode::TR_TRIANGLE_FILL:
-									m_shader_handler->rasterize_fill_edge_function(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
-								case TRPolygonMode::TR_TRIANGLE_WIRE:
-									m_shader_handler->rasterize_wire(vert[0], vert[1], vert[2],
-										m_backBuffer->getWidth(), m_backBuffer->getHeight(), rasterized_points);
-									break;
+								binTriangle(vert, m_draw_states.size() - 1);
+								continue;
 							}
-						}
-					}
 
-					if (rasterized_points.empty())
-					{
-						++m_clip_cull_profile.m_num_culled_triangles;
-					}
-					
-					//Fragment shader & Depth testing
-					for (auto &point : rasterized_points)
-					{
-						//Perspective correction after rasterization
-						TRShadingPipeline::VertexData::aftPrespCorrection(point);
-						if (depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
-							m_backBuffer->readDepth(point.spos.x, point.spos.y) > point.cpos.z)
-						{
-							glm::vec4 fragColor;
-							m_shader_handler->fragmentShader(point, fragColor);
-							m_backBuffer->writeColor(point.spos.x, point.spos.y, fragColor);
-							if (depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+							//Rasterization stage & Fragment shader & Depth testing
+							if (!rasterizeTriangle(vert, state, screen_scissor, *m_shader_handler, m_clip_cull_profile))
 							{
-								m_backBuffer->writeDepth(point.spos.x, point.spos.y, point.cpos.z);
+								++m_clip_cull_profile.m_num_culled_triangles;
 							}
 						}
 					}
-
-					rasterized_points.clear();
 				}
 			}
+		}
 
+		//Back end of the tile-binned rendering
+		if (tile_binning)
+		{
+			renderBinnedTiles(deferred);
+		}
+		//Lighting pass
+		else if (deferred)
+		{
+			shadeGBuffer(screen_scissor, *m_shader_handler);
 		}
 
+		//Overdraw statistics
+		m_clip_cull_profile.m_num_covered_pixels = m_backBuffer->countCoveredPixels();
+
 		//Swap double buffers
 		{
 			std::swap(m_backBuffer, m_frontBuffer);
@@ -278,6 +431,294 @@ namespace TinyRenderer
 		
 	}
 
+	bool TRRenderer::isOutsideFrustum(const TRDrawableMesh &mesh, const glm::mat4 &mvp)
+	{
+		//Bounding sphere against the frustum planes in local space
+		//Refs: Gribb G, Hartmann K. Fast extraction of viewing frustum planes from the world-view-projection matrix.
+		{
+			const glm::vec4 &sphere = mesh.getBoundingSphere();
+			const glm::vec4 row_x(mvp[0][0], mvp[1][0], mvp[2][0], mvp[3][0]);
+			const glm::vec4 row_y(mvp[0][1], mvp[1][1], mvp[2][1], mvp[3][1]);
+			const glm::vec4 row_z(mvp[0][2], mvp[1][2], mvp[2][2], mvp[3][2]);
+			const glm::vec4 row_w(mvp[0][3], mvp[1][3], mvp[2][3], mvp[3][3]);
+			const glm::vec4 planes[6] = {
+				row_w - row_x, row_w + row_x, row_w - row_y, row_w + row_y, row_w - row_z, row_w + row_z };
+			for (const auto &plane : planes)
+			{
+				//Signed distance scaled by the length of the plane normal
+				float dist = glm::dot(glm::vec3(plane), glm::vec3(sphere)) + plane.w;
+				if (dist < -sphere.w * glm::length(glm::vec3(plane)))
+					return true;
+			}
+		}
+
+		//The corners of the AABB all outside of the same clipping plane
+		{
+			const glm::vec3 &bmin = mesh.getAABBMin();
+			const glm::vec3 &bmax = mesh.getAABBMax();
+			unsigned int code = ~0u;
+			for (int i = 0; i < 8; ++i)
+			{
+				glm::vec4 corner((i & 1) ? bmax.x : bmin.x, (i & 2) ? bmax.y : bmin.y, (i & 4) ? bmax.z : bmin.z, 1.0f);
+				code &= calcOutCode(mvp * corner);
+			}
+			return code != 0;
+		}
+	}
+
+	void TRRenderer::shadeMeshVertices(const TRVertexAttrib &vertices)
+	{
+		const size_t num_vertices = vertices.size();
+		m_vertex_cache.resize(num_vertices);
+		m_shader_handler->vertexShaderBatch(vertices, 0, num_vertices, m_vertex_cache.data());
+		m_clip_cull_profile.m_num_shaded_vertices += num_vertices;
+	}
+
+	bool TRRenderer::rasterizeTriangle(
+		const TRShadingPipeline::VertexData vert[3],
+		const DrawState &state,
+		const glm::ivec4 &scissor,
+		TRShadingPipeline &shader,
+		Profile &profile)
+	{
+		//The specialized variant is picked once per triangle, not per fragment
+		//Note: the shader of a variant has to be a TRPhongShadingPipeline.
+		if (state.shaderVariant >= 0)
+		{
+			const auto &phong = static_cast<const TRPhongShadingPipeline&>(shader);
+			const PhongFragmentStage stage = { phong, TRPhongShadingPipeline::getVariantShaders(state.shaderVariant) };
+			return rasterizeTriangle(vert, state, scissor, stage, profile);
+		}
+		return rasterizeTriangle(vert, state, scissor, VirtualFragmentStage{ shader }, profile);
+	}
+
+	template<typename FragmentStage>
+	bool TRRenderer::rasterizeTriangle(
+		const TRShadingPipeline::VertexData vert[3],
+		const DrawState &state,
+		const glm::ivec4 &scissor,
+		const FragmentStage &stage,
+		Profile &profile)
+	{
+		//Fragment shader & Depth testing
+		//Note: fused into the rasterization loop, every fragment lives on the stack only
+		TRFrameBuffer &frameBuffer = *m_backBuffer;
+		auto early_depth_test = [&](int x, int y, float z) -> bool
+		{
+			//Early-Z: reject the fragment before interpolating the other attributes
+			if (state.depthtestMode == TRDepthTestMode::TR_DEPTH_TEST_ENABLE && frameBuffer.readDepth(x, y) > z)
+				return true;
+			++profile.m_num_early_z_rejected_fragments;
+			return false;
+		};
+		auto fragment_sink = [&](TRShadingPipeline::VertexData &point)
+		{
+			//Perspective correction after rasterization
+			TRShadingPipeline::VertexData::aftPrespCorrection(point);
+
+			if (state.deferred)
+			{
+				//Geometry pass, the lighting is done by shadeGBuffer
+				TRGBufferTexel texel;
+				stage.surfaceShader(point, texel);
+				texel.tint = state.tint;
+				frameBuffer.writeGBuffer(point.spos.x, point.spos.y, texel);
+			}
+			else
+			{
+				glm::vec4 fragColor;
+				stage.fragmentShader(point, fragColor);
+				fragColor *= glm::vec4(state.tint, 1.0f);
+				frameBuffer.writeColor(point.spos.x, point.spos.y, fragColor);
+			}
+			++profile.m_num_shaded_fragments;
+			if (state.depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+			{
+				frameBuffer.writeDepth(point.spos.x, point.spos.y, point.cpos.z);
+			}
+		};
+		auto span_sink = [&](TRShadingPipeline::FragmentSpan &span)
+		{
+			//Perspective correction after rasterization
+			span.aftPrespCorrection();
+
+			if (state.deferred)
+			{
+				//Geometry pass, one fragment at a time
+				TRShadingPipeline::VertexData point;
+				TRGBufferTexel texel;
+				for (unsigned int m = span.mask; m != 0; m &= m - 1)
+				{
+					const int i = TRBitScanForward(m);
+					span.fragment(i, point);
+					stage.surfaceShader(point, texel);
+					texel.tint = state.tint;
+					frameBuffer.writeGBuffer(span.x + i, span.y, texel);
+				}
+			}
+			else
+			{
+				glm::vec4 fragColors[TRShadingPipeline::FragmentSpan::max_width];
+				stage.fragmentShaderSpan(span, fragColors);
+				for (unsigned int m = span.mask; m != 0; m &= m - 1)
+				{
+					const int i = TRBitScanForward(m);
+					frameBuffer.writeColor(span.x + i, span.y, fragColors[i] * glm::vec4(state.tint, 1.0f));
+				}
+			}
+			for (unsigned int m = span.mask; m != 0; m &= m - 1)
+			{
+				const int i = TRBitScanForward(m);
+				++profile.m_num_shaded_fragments;
+				if (state.depthwriteMode == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE)
+				{
+					frameBuffer.writeDepth(span.x + i, span.y, span.depth[i]);
+				}
+			}
+		};
+
+		//Rasterization stage
+		unsigned int num_covered = 0;
+		switch (state.polygonMode)
+		{
+			case TRPolygonMode::TR_TRIANGLE_FILL:
+				num_covered = TRShadingPipeline::rasterize_fill_edge_function(vert[0], vert[1], vert[2], scissor, early_depth_test, span_sink);
+				break;
+			case TRPolygonMode::TR_TRIANGLE_WIRE:
+				num_covered = TRShadingPipeline::rasterize_wire(vert[0], vert[1], vert[2], scissor, early_depth_test, fragment_sink);
+				break;
+		}
+
+		profile.m_num_rasterized_fragments += num_covered;
+		return num_covered > 0;
+	}
+
+	void TRRenderer::shadeGBuffer(const glm::ivec4 &rect, const TRShadingPipeline &shader)
+	{
+		TRFrameBuffer &frameBuffer = *m_backBuffer;
+		TRGBufferTexel texel;
+		for (int y = rect.y; y <= rect.w; ++y)
+		{
+			for (int x = rect.x; x <= rect.z; ++x)
+			{
+				//Empty pixel
+				if (!frameBuffer.readGBuffer(x, y, texel))
+					continue;
+
+				glm::vec4 fragColor;
+				shader.lightingShader(texel, fragColor);
+				fragColor *= glm::vec4(texel.tint, 1.0f);
+				frameBuffer.writeColor(x, y, fragColor);
+			}
+		}
+	}
+
+	void TRRenderer::binTriangle(const TRShadingPipeline::VertexData vert[3], unsigned int state)
+	{
+		unsigned int index = m_binned_triangles.size();
+		m_binned_triangles.push_back({ { vert[0], vert[1], vert[2] }, state });
+
+		//Screen space bounding box -> covered tiles
+		int min_x = std::max(std::min(vert[0].spos.x, std::min(vert[1].spos.x, vert[2].spos.x)), 0);
+		int min_y = std::max(std::min(vert[0].spos.y, std::min(vert[1].spos.y, vert[2].spos.y)), 0);
+		int max_x = std::min(std::max(vert[0].spos.x, std::max(vert[1].spos.x, vert[2].spos.x)), m_backBuffer->getWidth() - 1);
+		int max_y = std::min(std::max(vert[0].spos.y, std::max(vert[1].spos.y, vert[2].spos.y)), m_backBuffer->getHeight() - 1);
+		if (min_x > max_x || min_y > max_y)
+			return;
+
+		for (int ty = min_y / m_tile_size; ty <= max_y / m_tile_size; ++ty)
+		{
+			for (int tx = min_x / m_tile_size; tx <= max_x / m_tile_size; ++tx)
+			{
+				m_tile_bins[ty * m_tile_cols + tx].push_back(index);
+			}
+		}
+	}
+
+	void TRRenderer::renderBinnedTiles(bool deferred)
+	{
+		const int num_tiles = m_tile_cols * m_tile_rows;
+		const int num_threads = std::min(m_thread_num, num_tiles);
+		const int width = m_backBuffer->getWidth();
+		const int height = m_backBuffer->getHeight();
+
+		//Each worker grabs the next unprocessed tile, so a tile is owned by exactly one thread
+		std::atomic<int> next_tile(0);
+		std::vector<std::vector<unsigned int>> covered_triangles(num_threads);
+		std::vector<Profile> profiles(num_threads);
+		auto worker = [&](int tid)
+		{
+			//Private shader for the per face material settings
+			TRShadingPipeline::ptr shader = m_shader_handler->clone();
+			for (int t = next_tile++; t < num_tiles; t = next_tile++)
+			{
+				const auto &bin = m_tile_bins[t];
+				if (bin.empty())
+					continue;
+
+				const int tx = (t % m_tile_cols) * m_tile_size;
+				const int ty = (t / m_tile_cols) * m_tile_size;
+				const glm::ivec4 scissor(tx, ty,
+					std::min(tx + m_tile_size, width) - 1,
+					std::min(ty + m_tile_size, height) - 1);
+
+				//Triangles are kept in submission order inside a bin, so the result matches the serial path
+				unsigned int current_state = static_cast<unsigned int>(-1);
+				for (const auto &index : bin)
+				{
+					const auto &tri = m_binned_triangles[index];
+					const auto &state = m_draw_states[tri.state];
+					if (tri.state != current_state)
+					{
+						current_state = tri.state;
+						shader->setLightingEnable(state.lightingEnable);
+						applyMaterial(*shader, *state.material);
+					}
+					if (rasterizeTriangle(tri.v, state, scissor, *shader, profiles[tid]))
+					{
+						covered_triangles[tid].push_back(index);
+					}
+				}
+
+				//Lighting pass of the finished tile
+				if (deferred)
+				{
+					shadeGBuffer(scissor, *shader);
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (int i = 1; i < num_threads; ++i)
+		{
+			threads.emplace_back(worker, i);
+		}
+		worker(0);
+		for (auto &th : threads)
+		{
+			th.join();
+		}
+
+		//Triangles that cover no pixel in any tile
+		std::vector<bool> covered(m_binned_triangles.size(), false);
+		for (const auto &list : covered_triangles)
+		{
+			for (const auto &index : list)
+			{
+				covered[index] = true;
+			}
+		}
+		m_clip_cull_profile.m_num_culled_triangles += std::count(covered.begin(), covered.end(), false);
+
+		//Fragment statistics of all the workers
+		for (const auto &profile : profiles)
+		{
+			m_clip_cull_profile.m_num_rasterized_fragments += profile.m_num_rasterized_fragments;
+			m_clip_cull_profile.m_num_early_z_rejected_fragments += profile.m_num_early_z_rejected_fragments;
+			m_clip_cull_profile.m_num_shaded_fragments += profile.m_num_shaded_fragments;
+		}
+	}
+
 	unsigned char* TRRenderer::commitRenderedColorBuffer()
 	{
 		return m_frontBuffer->getColorBuffer();
@@ -293,137 +734,161 @@ namespace TinyRenderer
 		return m_clip_cull_profile.m_num_culled_triangles;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman(
+	unsigned int TRRenderer::getNumberOfCulledMeshes() const
+	{
+		return m_clip_cull_profile.m_num_culled_meshes;
+	}
+
+	unsigned int TRRenderer::getNumberOfRasterizedFragments() const
+	{
+		return m_clip_cull_profile.m_num_rasterized_fragments;
+	}
+
+	unsigned int TRRenderer::getNumberOfEarlyZRejectedFragments() const
+	{
+		return m_clip_cull_profile.m_num_early_z_rejected_fragments;
+	}
+
+	unsigned int TRRenderer::getNumberOfShadedVertices() const
+	{
+		return m_clip_cull_profile.m_num_shaded_vertices;
+	}
+
+	unsigned int TRRenderer::getNumberOfShadedFragments() const
+	{
+		return m_clip_cull_profile.m_num_shaded_fragments;
+	}
+
+	unsigned int TRRenderer::getNumberOfCoveredPixels() const
+	{
+		return m_clip_cull_profile.m_num_covered_pixels;
+	}
+
+	float TRRenderer::getOverdraw() const
+	{
+		const unsigned int num_pixels = m_clip_cull_profile.m_num_covered_pixels;
+		return num_pixels == 0 ? 0.0f : static_cast<float>(m_clip_cull_profile.m_num_shaded_fragments) / num_pixels;
+	}
+
+	bool TRRenderer::clipingSutherlandHodgeman(
 		const TRShadingPipeline::VertexData &v0,
 		const TRShadingPipeline::VertexData &v1,
-		const TRShadingPipeline::VertexData &v2) const
+		const TRShadingPipeline::VertexData &v2,
+		ClipPolygon &polygon) const
 	{
 		//Clipping in the homogeneous clipping space
 		//Refs:
 		//https://fabiensanglard.net/polygon_codec/clippingdocument/Clipping.pdf
 		//https://fabiensanglard.net/polygon_codec/
 
+		polygon.vertices[0] = v0;
+		polygon.vertices[1] = v1;
+		polygon.vertices[2] = v2;
+		polygon.size = 3;
+
 		//Optimization: complete outside or complete inside
 		//Note: in the following situations, we could return the answer without complicate cliping,
 		//      and this optimization should be very important.
+		const unsigned int code0 = calcOutCode(v0.cpos);
+		const unsigned int code1 = calcOutCode(v1.cpos);
+		const unsigned int code2 = calcOutCode(v2.cpos);
 		{
+			//Totally outside: all the vertices are outside of the same plane
+			if ((code0 & code1 & code2) != 0)
+			{
+				polygon.size = 0;
+				return false;
+			}
+
 			//Totally inside
-			if (isPointInsideInClipingFrustum(v0.cpos)
-				&& isPointInsideInClipingFrustum(v1.cpos)
-				&& isPointInsideInClipingFrustum(v2.cpos))
+			if ((code0 | code1 | code2) == 0)
 			{
-				return { v0,v1,v2 };
+				return true;
 			}
-			//Totally outside
-			if (v0.cpos.w < m_frustum_near_far.x && v1.cpos.w < m_frustum_near_far.x && v2.cpos.w < m_frustum_near_far.x)
-				return{};
-			if (v0.cpos.w > m_frustum_near_far.y && v1.cpos.w > m_frustum_near_far.y && v2.cpos.w > m_frustum_near_far.y)
-				return{};
-			if (v0.cpos.x > v0.cpos.w && v1.cpos.x > v1.cpos.w && v2.cpos.x > v2.cpos.w)
-				return{};
-			if (v0.cpos.x <-v0.cpos.w && v1.cpos.x <-v1.cpos.w && v2.cpos.x <-v2.cpos.w)
-				return{};
-			if (v0.cpos.y > v0.cpos.w && v1.cpos.y > v1.cpos.w && v2.cpos.y > v2.cpos.w)
-				return{};
-			if (v0.cpos.y <-v0.cpos.w && v1.cpos.y <-v1.cpos.w && v2.cpos.y <-v2.cpos.w)
-				return{};
-			if (v0.cpos.z > v0.cpos.w && v1.cpos.z > v1.cpos.w && v2.cpos.z > v2.cpos.w)
-				return{};
-			if (v0.cpos.z <-v0.cpos.w && v1.cpos.z <-v1.cpos.w && v2.cpos.z <-v2.cpos.w)
-				return{};
 		}
 
-		std::vector<TRShadingPipeline::VertexData> inside_vertices;
-		std::vector<TRShadingPipeline::VertexData> tmp = { v0, v1, v2 };
-		enum Axis { X = 0, Y = 1, Z = 2};
+		//Only the planes that the triangle crosses
+		unsigned int crossed = code0 | code1 | code2;
 
-		//w=x plane & w=-x plane
+		//Guard band: no x/y clipping if the triangle stays inside the guard band,
+		//the rasterizer clamps it to the screen instead
+		if (m_guard_band > 1.0f)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::X, -1);
-			tmp = inside_vertices;
-		}
-
-		//w=y plane & w=-y plane
-		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, +1);
-			tmp = inside_vertices;
-
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Y, -1);
-			tmp = inside_vertices;
+			constexpr unsigned int xy_planes =
+				(1u << CLIP_POS_X) | (1u << CLIP_NEG_X) | (1u << CLIP_POS_Y) | (1u << CLIP_NEG_Y);
+			unsigned int guard_crossed = calcGuardBandOutCode(v0.cpos, m_guard_band)
+				| calcGuardBandOutCode(v1.cpos, m_guard_band) | calcGuardBandOutCode(v2.cpos, m_guard_band);
+			if (guard_crossed == 0)
+			{
+				crossed &= ~xy_planes;
+				if (crossed == 0)
+					return true;
+			}
 		}
 
-		//w=z plane & w=-z plane
+		//Ping-pong between two stack polygons
+		ClipPolygon tmp;
+		ClipPolygon *src = &polygon, *dst = &tmp;
+		for (int plane = 0; plane < CLIP_PLANE_NUM; ++plane)
 		{
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, +1);
-			tmp = inside_vertices;
+			if ((crossed & (1u << plane)) == 0)
+				continue;
 
-			inside_vertices = clipingSutherlandHodgeman_aux(tmp, Axis::Z, -1);
-			tmp = inside_vertices;
+			clipingSutherlandHodgeman_aux(*src, plane, *dst);
+			std::swap(src, dst);
+			if (src->size == 0)
+			{
+				polygon.size = 0;
+				return false;
+			}
 		}
 
-		//w=1e-5 plane
+		if (src != &polygon)
 		{
-			inside_vertices = {};
-			int num_verts = tmp.size();
-			constexpr float w_clipping_plane = 1e-5;
-			for (int i = 0; i < num_verts; ++i)
-			{
-				const auto &beg_vert = tmp[(i - 1 + num_verts) % num_verts];
-				const auto &end_vert = tmp[i];
-				float beg_is_inside = (beg_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				float end_is_inside = (end_vert.cpos.w < w_clipping_plane) ? -1 : 1;
-				//One of them is outside
-				if (beg_is_inside * end_is_inside < 0)
-				{
-					// t = (w_clipping_plane-w1)/((w1-w2)
-					float t = (w_clipping_plane - beg_vert.cpos.w) / (beg_vert.cpos.w - end_vert.cpos.w);
-					auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-					inside_vertices.push_back(intersected_vert);
-				}
-				//If current vertices is inside
-				if (end_is_inside > 0)
-				{
-					inside_vertices.push_back(end_vert);
-				}
-			}
+			std::copy(src->vertices, src->vertices + src->size, polygon.vertices);
+			polygon.size = src->size;
 		}
-		
-		return inside_vertices;
+		return polygon.size >= 3;
 	}
 
-	std::vector<TRShadingPipeline::VertexData> TRRenderer::clipingSutherlandHodgeman_aux(
-		const std::vector<TRShadingPipeline::VertexData> &polygon,
-		const int &axis,
-		const int &side) const
+	void TRRenderer::clipingSutherlandHodgeman_aux(
+		const ClipPolygon &polygon,
+		const int &plane,
+		ClipPolygon &inside_polygon) const
 	{
-		std::vector<TRShadingPipeline::VertexData> inside_polygon;
+		inside_polygon.size = 0;
+
+		//Note: a convex polygon gains one vertex at most, a numerically degenerate one could gain more,
+		//      the vertices beyond the capacity are dropped then.
+		auto push_vertex = [&inside_polygon](const TRShadingPipeline::VertexData &v)
+		{
+			assert(inside_polygon.size < ClipPolygon::max_vertices);
+			if (inside_polygon.size < ClipPolygon::max_vertices)
+				inside_polygon.vertices[inside_polygon.size++] = v;
+		};
 
-		int num_verts = polygon.size();
+		int num_verts = polygon.size;
 		for (int i = 0; i < num_verts; ++i)
 		{
-			const auto &beg_vert = polygon[(i - 1 + num_verts) % num_verts];
-			const auto &end_vert = polygon[i];
-			char beg_is_inside = ((side * (beg_vert.cpos[axis]) <= beg_vert.cpos.w) ? 1 : -1);
-			char end_is_inside = ((side * (end_vert.cpos[axis]) <= end_vert.cpos.w) ? 1 : -1);
+			const auto &beg_vert = polygon.vertices[(i - 1 + num_verts) % num_verts];
+			const auto &end_vert = polygon.vertices[i];
+			float beg_dist = clipPlaneDistance(beg_vert.cpos, plane);
+			float end_dist = clipPlaneDistance(end_vert.cpos, plane);
+			bool beg_is_inside = beg_dist >= 0.0f;
+			bool end_is_inside = end_dist >= 0.0f;
 			//One of them is outside
-			if (beg_is_inside * end_is_inside < 0)
+			if (beg_is_inside != end_is_inside)
 			{
-				// t = (w1 - y1)/((w1-y1)-(w2-y2))
-				float t = (beg_vert.cpos.w - side * beg_vert.cpos[axis])
-					/ ((beg_vert.cpos.w - side * beg_vert.cpos[axis]) - (end_vert.cpos.w - side * end_vert.cpos[axis]));
-				auto intersected_vert = TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t);
-				inside_polygon.push_back(intersected_vert);
+				// t = d1/(d1-d2), e.g., t = (w1 - y1)/((w1-y1)-(w2-y2))
+				float t = beg_dist / (beg_dist - end_dist);
+				push_vertex(TRShadingPipeline::VertexData::lerp(beg_vert, end_vert, t));
 			}
 			//If current vertices is inside
-			if (end_is_inside > 0)
+			if (end_is_inside)
 			{
-				inside_polygon.push_back(end_vert);
+				push_vertex(end_vert);
 			}
 		}
-		return inside_polygon;
 	}
 
 	bool TRRenderer::isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const
@@ -10,6 +10,8 @@
 #include "TRShadingPipeline.h"
 
 #include <mutex>
+#include <thread>
+#include <atomic>
 
 namespace TinyRenderer
 {
@@ -19,9 +21,10 @@ namespace TinyRenderer
 		typedef std::shared_ptr<TRRenderer> ptr;
 
 		TRRenderer(int width, int height);
-		~TRRenderer() = default;
+		~TRRenderer();
 
 		//Drawable objects load/unload
+		//Note: the meshes are indexed by a BVH for view frustum culling, a mesh can be added to one renderer only.
 		void addDrawableMesh(TRDrawableMesh::ptr mesh);
 		void addDrawableMesh(const std::vector<TRDrawableMesh::ptr> &meshes);
 		void unloadDrawableMesh();
@@ -41,8 +44,42 @@ namespace TinyRenderer
 		int addSpotLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 dir, glm::vec3 color, float cutOff , float outerCutOff);
 		TRSpotLight& getSpotLight(const int& index);
 		void clearSpotLight();
+
+		//Clustered light culling: a point light is ignored where its attenuated intensity is below the threshold
+		//Note: 0 disables the culling, i.e., every fragment is lit by all the point lights.
+		void setLightCullingThreshold(float threshold) { m_light_culling_threshold = threshold; }
+		float getLightCullingThreshold() const { return m_light_culling_threshold; }
+
+		//Fast math lighting: vector pow/exp approximations in the SIMD lighting of the spans
+		//Note: off by default, i.e., exactly the colors of the scalar shaders. The error of x^y grows with the
+		//      exponent (see TRPow in TRSimd.h): about 3e-5 relative for a shininess of 100 at small cosines.
+		void setFastMath(bool enable) { TRShadingPipeline::setFastMath(enable); }
+		bool getFastMath() const { return TRShadingPipeline::getFastMath(); }
 		glm::mat4 getMVPMatrix();
 
+		//Guard-band clipping: triangles inside [-extent*w, extent*w] in x and y are only clipped by the near/far (and w)
+		//planes, and the rest of them is scissored by the rasterizer. extent <= 1 disables it.
+		void setGuardBand(float extent);
+		float getGuardBand() const { return m_guard_band; }
+
+		//Draw order: front-to-back sorting lets the depth test reject the hidden fragments before they are shaded
+		//Note: submission order by default. The sorting key is the farthest view space depth of the AABB, so that the
+		//      enclosing geometry (e.g., a room around the models) is drawn after the things inside of it.
+		//      Only the meshes with the depth test and the depth write enabled are sorted, the other ones (e.g., overlays
+		//      or a skybox) are drawn after them in the submission order, and so are their submeshes and faces.
+		void setDrawOrder(TRDrawOrderMode mode) { m_draw_order = mode; }
+		TRDrawOrderMode getDrawOrder() const { return m_draw_order; }
+
+		//Deferred shading: the fragments write their surface attributes to a G-buffer, then every covered pixel
+		//is lit once, i.e., the lighting cost is per pixel instead of per fragment.
+		//Note: only for the pipelines with a deferred path (see TRShadingPipeline::hasDeferredPath).
+		void setDeferredShading(bool enable);
+		bool getDeferredShading() const { return m_deferred_shading; }
+
+		//Multi-threading: 1 -> serial rendering, >1 -> tile-binned rendering with the given threads
+		void setThreadNum(int num);
+		int getThreadNum() const { return m_thread_num; }
+
 		//Draw call
 		void renderAllDrawableMeshes();
 
@@ -50,36 +87,194 @@ namespace TinyRenderer
 		unsigned char* commitRenderedColorBuffer();
 		unsigned int getNumberOfClipFaces() const;
 		unsigned int getNumberOfCullFaces() const;
+		unsigned int getNumberOfCulledMeshes() const;    //Meshes rejected by the scene index and instances rejected one by one
+		unsigned int getNumberOfRasterizedFragments() const;
+		unsigned int getNumberOfEarlyZRejectedFragments() const;
+		unsigned int getNumberOfShadedVertices() const;
+		unsigned int getNumberOfShadedFragments() const;
+		unsigned int getNumberOfCoveredPixels() const;
+		float getOverdraw() const;    //Shaded fragments per covered pixel
 
 	private:
 
+		struct Profile
+		{
+			unsigned int m_num_cliped_triangles = 0;
+			unsigned int m_num_culled_triangles = 0;
+			unsigned int m_num_culled_meshes = 0;
+			unsigned int m_num_rasterized_fragments = 0;
+			unsigned int m_num_early_z_rejected_fragments = 0;
+			unsigned int m_num_shaded_vertices = 0;
+			unsigned int m_num_shaded_fragments = 0;
+			unsigned int m_num_covered_pixels = 0;
+		};
+
+		//A mesh instance to draw and its view space depth
+		struct DrawItem
+		{
+			int mesh;
+			unsigned int instance;
+			float depth;
+		};
+
+		//Render state of a submesh (instance)
+		struct DrawState
+		{
+			const TRMaterial *material;
+			TRPolygonMode polygonMode;
+			TRDepthTestMode depthtestMode;
+			TRDepthWriteMode depthwriteMode;
+			bool lightingEnable;
+			glm::vec3 tint;     //Modulates the fragment colors (per instance)
+			bool deferred;      //Write the G-buffer instead of the color buffer
+			int shaderVariant;  //Specialized fragment shader of the pipeline, -1 for the virtual ones
+		};
+
+		//Fragment stages of the fused rasterization loop, known at compile time
+		//Note: the generic one calls the virtual shaders, the Phong one calls the entry points of a specialized variant.
+		struct VirtualFragmentStage
+		{
+			TRShadingPipeline &shader;
+			void fragmentShader(const TRShadingPipeline::VertexData &data, glm::vec4 &fragColor) const { shader.fragmentShader(data, fragColor); }
+			void surfaceShader(const TRShadingPipeline::VertexData &data, TRGBufferTexel &texel) const { shader.surfaceShader(data, texel); }
+			void fragmentShaderSpan(const TRShadingPipeline::FragmentSpan &span, glm::vec4 *fragColors) const { shader.fragmentShaderSpan(span, fragColors); }
+		};
+		struct PhongFragmentStage
+		{
+			const TRPhongShadingPipeline &shader;
+			const TRPhongShadingPipeline::VariantShaders &variant;
+			void fragmentShader(const TRShadingPipeline::VertexData &data, glm::vec4 &fragColor) const { (shader.*variant.fragmentShader)(data, fragColor); }
+			void surfaceShader(const TRShadingPipeline::VertexData &data, TRGBufferTexel &texel) const { (shader.*variant.surfaceShader)(data, texel); }
+			void fragmentShaderSpan(const TRShadingPipeline::FragmentSpan &span, glm::vec4 *fragColors) const { (shader.*variant.fragmentShaderSpan)(span, fragColors); }
+		};
+
+		//Fixed capacity polygon for clipping, so that no heap allocation happens per triangle
+		//Note: each clipping plane adds one vertex at most, i.e., 9 vertices for the six frustum planes
+		//      and one more for the w=epsilon plane.
+		struct ClipPolygon
+		{
+			static constexpr int max_vertices = 10;
+			TRShadingPipeline::VertexData vertices[max_vertices];
+			int size = 0;
+		};
+
 		//Homogeneous space clipping - Sutherland Hodgeman algorithm
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman(
+		//Note: return false if the triangle is totally outside
+		bool clipingSutherlandHodgeman(
 			const TRShadingPipeline::VertexData &v0,
 			const TRShadingPipeline::VertexData &v1,
-			const TRShadingPipeline::VertexData &v2) const;
+			const TRShadingPipeline::VertexData &v2,
+			ClipPolygon &polygon) const;
 
 		//Cliping auxiliary functions
-		std::vector<TRShadingPipeline::VertexData> clipingSutherlandHodgeman_aux(
-			const std::vector<TRShadingPipeline::VertexData> &polygon,
-			const int &axis, 
-			const int &side) const;
-		bool isPointInsideInClipingFrustum(const glm::vec4 &p) const
+		enum ClipPlane { CLIP_POS_X = 0, CLIP_NEG_X, CLIP_POS_Y, CLIP_NEG_Y, CLIP_POS_Z, CLIP_NEG_Z, CLIP_W, CLIP_PLANE_NUM };
+		void clipingSutherlandHodgeman_aux(
+			const ClipPolygon &polygon,
+			const int &plane,
+			ClipPolygon &inside_polygon) const;
+		static float clipPlaneDistance(const glm::vec4 &p, const int &plane)
 		{
-			return (p.x <= p.w && p.x >= -p.w)
-				&& (p.y <= p.w && p.y >= -p.w)
-				&& (p.z <= p.w && p.z >= -p.w)
-				&& (p.w <= m_frustum_near_far.y && p.w >= m_frustum_near_far.x);
+			//Signed distance to the clipping plane, non-negative means inside
+			constexpr float w_clipping_plane = 1e-5f;
+			switch (plane)
+			{
+			case CLIP_POS_X: return p.w - p.x;
+			case CLIP_NEG_X: return p.w + p.x;
+			case CLIP_POS_Y: return p.w - p.y;
+			case CLIP_NEG_Y: return p.w + p.y;
+			case CLIP_POS_Z: return p.w - p.z;
+			case CLIP_NEG_Z: return p.w + p.z;
+			default: return p.w - w_clipping_plane;
+			}
+		}
+		static unsigned int calcOutCode(const glm::vec4 &p)
+		{
+			//One bit per clipping plane the point is outside of
+			unsigned int code = 0;
+			for (int plane = 0; plane < CLIP_PLANE_NUM; ++plane)
+			{
+				code |= (clipPlaneDistance(p, plane) < 0.0f) ? (1u << plane) : 0u;
+			}
+			return code;
+		}
+		static unsigned int calcGuardBandOutCode(const glm::vec4 &p, float extent)
+		{
+			//Same bits as calcOutCode but for the x/y planes of the guard band
+			unsigned int code = 0;
+			code |= (p.x > extent * p.w) ? (1u << CLIP_POS_X) : 0u;
+			code |= (p.x < -extent * p.w) ? (1u << CLIP_NEG_X) : 0u;
+			code |= (p.y > extent * p.w) ? (1u << CLIP_POS_Y) : 0u;
+			code |= (p.y < -extent * p.w) ? (1u << CLIP_NEG_Y) : 0u;
+			return code;
+		}
+
+		//Post-transform vertex cache
+		//Note: each unique vertex of a mesh is shaded once per frame, the faces index into the result.
+		void shadeMeshVertices(const TRVertexAttrib &vertices);
+
+		//View frustum culling of a whole mesh with its bounding volumes
+		//Note: return true if the mesh is totally outside
+		static bool isOutsideFrustum(const TRDrawableMesh &mesh, const glm::mat4 &mvp);
+
+		//Farthest view space depth (distance along the view direction) of a local space AABB
+		static float calcFarViewDepth(const glm::mat4 &modelView, const glm::vec3 &bmin, const glm::vec3 &bmax)
+		{
+			const glm::vec3 center = (bmin + bmax) * 0.5f;
+			const glm::vec3 extent = (bmax - bmin) * 0.5f;
+			const glm::vec3 view_dir(-modelView[0][2], -modelView[1][2], -modelView[2][2]);
+			return glm::dot(view_dir, center) - modelView[3][2] + glm::dot(glm::abs(view_dir), extent);
+		}
+
+		//Meshes reordered by the front-to-back draw order, i.e., the ones with the depth test and write
+		static bool isDepthOrdered(const TRDrawableMesh &mesh)
+		{
+			return mesh.getDepthtestMode() == TRDepthTestMode::TR_DEPTH_TEST_ENABLE &&
+				mesh.getDepthwriteMode() == TRDepthWriteMode::TR_DEPTH_WRITE_ENABLE;
 		}
 
 		//Back face culling
 		bool isBackFacing(const glm::ivec2 &v0, const glm::ivec2 &v1, const glm::ivec2 &v2, TRCullFaceMode mode) const;
 
+		//Per submesh shading options
+		static void applyMaterial(TRShadingPipeline &shader, const TRMaterial &material);
+
+		//Rasterization, depth testing and fragment shading of a screen space triangle inside the scissor rect
+		//Note: return false if no pixel is covered
+		bool rasterizeTriangle(
+			const TRShadingPipeline::VertexData vert[3],
+			const DrawState &state,
+			const glm::ivec4 &scissor,
+			TRShadingPipeline &shader,
+			Profile &profile);
+		template<typename FragmentStage>
+		bool rasterizeTriangle(
+			const TRShadingPipeline::VertexData vert[3],
+			const DrawState &state,
+			const glm::ivec4 &scissor,
+			const FragmentStage &stage,
+			Profile &profile);
+
+		//Lighting pass of the deferred shading over the pixels of the rect (min_x, min_y, max_x, max_y), inclusive
+		void shadeGBuffer(const glm::ivec4 &rect, const TRShadingPipeline &shader);
+
+		//Tile-binned rendering (sort-middle)
+		//Note: with the deferred shading, a tile is lit by its worker as soon as its triangles are done.
+		void binTriangle(const TRShadingPipeline::VertexData vert[3], unsigned int state);
+		void renderBinnedTiles(bool deferred);
+
 	private:
 
 		//Drawable mesh array
 		std::vector<TRDrawableMesh::ptr> m_drawableMeshes;
 
+		//Scene index of the drawable meshes, the user data of a leaf is the index in m_drawableMeshes
+		TRSceneBVH m_scene_bvh;
+		std::vector<int> m_visible_meshes;
+
+		//Visible mesh instances in draw order
+		TRDrawOrderMode m_draw_order = TRDrawOrderMode::TR_DRAW_ORDER_SUBMISSION;
+		std::vector<DrawItem> m_draw_items;
+
 		//MVP transformation matrices
 		glm::mat4 m_viewMatrix = glm::mat4(1.0f);
 		glm::mat4 m_modelMatrix = glm::mat4(1.0f);
@@ -93,6 +288,12 @@ namespace TinyRenderer
 		//Viewport transformation (ndc space -> screen space)
 		glm::mat4 m_viewportMatrix = glm::mat4(1.0f);
 
+		//Guard band extent in ndc space
+		float m_guard_band = 1.0f;
+
+		bool m_deferred_shading = false;
+		float m_light_culling_threshold = 0.0f;
+
 		//Shader pipeline handler
 		TRShadingPipeline::ptr m_shader_handler = nullptr;
 
@@ -100,11 +301,24 @@ namespace TinyRenderer
 		TRFrameBuffer::ptr m_backBuffer;                      // The frame buffer that's going to be written.
 		TRFrameBuffer::ptr m_frontBuffer;                     // The frame buffer that's going to be displayed.
 
-		struct Profile
+		//Tile-binned rendering
+		//Note: the front end records the render state of each face and bins its screen space triangles
+		//      into tiles, then every tile is rasterized by exactly one thread so no lock is needed.
+		static constexpr int m_tile_size = 64;
+		struct BinnedTriangle
 		{
-			unsigned int m_num_cliped_triangles = 0;
-			unsigned int m_num_culled_triangles = 0;
+			TRShadingPipeline::VertexData v[3];
+			unsigned int state;
 		};
+		int m_thread_num = 1;
+		int m_tile_cols = 0, m_tile_rows = 0;
+		std::vector<DrawState> m_draw_states;
+		std::vector<BinnedTriangle> m_binned_triangles;
+		std::vector<std::vector<unsigned int>> m_tile_bins;
+
+		//Post-transform vertex cache
+		std::vector<TRShadingPipeline::VertexData> m_vertex_cache;
+
 		Profile m_clip_cull_profile;
 	};
 }
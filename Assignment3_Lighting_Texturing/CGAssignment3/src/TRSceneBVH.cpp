@@ -0,0 +1,327 @@
+#include "TRSceneBVH.h"
+
+#include <algorithm>
+
+namespace TinyRenderer
+{
+	//Refs: Catto E. Dynamic bounding volume hierarchies, GDC 2019.
+	//      https://box2d.org/files/ErinCatto_DynamicBVH_GDC2019.pdf
+
+	int TRSceneBVH::createProxy(const glm::vec3 &bmin, const glm::vec3 &bmax, int userData)
+	{
+		int proxy = allocateNode();
+
+		//Enlarged AABB so that the leaf survives small movements
+		glm::vec3 margin = glm::vec3(0.1f * glm::length(bmax - bmin));
+		m_nodes[proxy].bmin = bmin - margin;
+		m_nodes[proxy].bmax = bmax + margin;
+		m_nodes[proxy].userData = userData;
+		m_nodes[proxy].height = 0;
+
+		insertLeaf(proxy);
+		return proxy;
+	}
+
+	void TRSceneBVH::destroyProxy(int proxy)
+	{
+		removeLeaf(proxy);
+		freeNode(proxy);
+	}
+
+	bool TRSceneBVH::moveProxy(int proxy, const glm::vec3 &bmin, const glm::vec3 &bmax)
+	{
+		Node &node = m_nodes[proxy];
+		if (glm::all(glm::lessThanEqual(node.bmin, bmin)) && glm::all(glm::lessThanEqual(bmax, node.bmax)))
+			return false;
+
+		removeLeaf(proxy);
+		glm::vec3 margin = glm::vec3(0.1f * glm::length(bmax - bmin));
+		m_nodes[proxy].bmin = bmin - margin;
+		m_nodes[proxy].bmax = bmax + margin;
+		insertLeaf(proxy);
+		return true;
+	}
+
+	void TRSceneBVH::clear()
+	{
+		std::vector<Node>().swap(m_nodes);
+		m_root = -1;
+		m_free_list = -1;
+	}
+
+	void TRSceneBVH::queryFrustum(const glm::mat4 &viewProject, std::vector<int> &results) const
+	{
+		if (m_root == -1)
+			return;
+
+		//Frustum planes, the inside is where dot(plane.xyz, p) + plane.w >= 0
+		const glm::mat4 &m = viewProject;
+		const glm::vec4 row_x(m[0][0], m[1][0], m[2][0], m[3][0]);
+		const glm::vec4 row_y(m[0][1], m[1][1], m[2][1], m[3][1]);
+		const glm::vec4 row_z(m[0][2], m[1][2], m[2][2], m[3][2]);
+		const glm::vec4 row_w(m[0][3], m[1][3], m[2][3], m[3][3]);
+		const glm::vec4 planes[6] = {
+			row_w - row_x, row_w + row_x, row_w - row_y, row_w + row_y, row_w - row_z, row_w + row_z };
+		constexpr unsigned int all_planes = (1u << 6) - 1;
+
+		//Depth first traversal, each entry carries the planes its AABB still intersects
+		//Note: the subtree of a node totally inside of a plane doesn't need to test that plane again.
+		std::vector<std::pair<int, unsigned int>> stack;
+		stack.push_back({ m_root, all_planes });
+		while (!stack.empty())
+		{
+			const int index = stack.back().first;
+			unsigned int mask = stack.back().second;
+			stack.pop_back();
+			const Node &node = m_nodes[index];
+
+			bool outside = false;
+			for (int p = 0; p < 6 && !outside; ++p)
+			{
+				if ((mask & (1u << p)) == 0)
+					continue;
+
+				//The farthest corner along the plane normal and the nearest one
+				const glm::vec4 &plane = planes[p];
+				glm::vec3 pos_vertex(plane.x >= 0.0f ? node.bmax.x : node.bmin.x,
+					plane.y >= 0.0f ? node.bmax.y : node.bmin.y, plane.z >= 0.0f ? node.bmax.z : node.bmin.z);
+				glm::vec3 neg_vertex(plane.x >= 0.0f ? node.bmin.x : node.bmax.x,
+					plane.y >= 0.0f ? node.bmin.y : node.bmax.y, plane.z >= 0.0f ? node.bmin.z : node.bmax.z);
+				if (glm::dot(glm::vec3(plane), pos_vertex) + plane.w < 0.0f)
+					outside = true;
+				else if (glm::dot(glm::vec3(plane), neg_vertex) + plane.w >= 0.0f)
+					mask &= ~(1u << p);
+			}
+			if (outside)
+				continue;
+
+			if (node.isLeaf())
+			{
+				results.push_back(node.userData);
+			}
+			else
+			{
+				stack.push_back({ node.child1, mask });
+				stack.push_back({ node.child2, mask });
+			}
+		}
+	}
+
+	int TRSceneBVH::allocateNode()
+	{
+		if (m_free_list == -1)
+		{
+			m_nodes.push_back(Node());
+			return static_cast<int>(m_nodes.size() - 1);
+		}
+
+		int node = m_free_list;
+		m_free_list = m_nodes[node].parent;
+		m_nodes[node] = Node();
+		return node;
+	}
+
+	void TRSceneBVH::freeNode(int node)
+	{
+		m_nodes[node].parent = m_free_list;
+		m_nodes[node].height = -1;
+		m_free_list = node;
+	}
+
+	void TRSceneBVH::insertLeaf(int leaf)
+	{
+		if (m_root == -1)
+		{
+			m_root = leaf;
+			m_nodes[m_root].parent = -1;
+			return;
+		}
+
+		//Find the best sibling with the surface area heuristic
+		const glm::vec3 leaf_min = m_nodes[leaf].bmin;
+		const glm::vec3 leaf_max = m_nodes[leaf].bmax;
+		int index = m_root;
+		while (!m_nodes[index].isLeaf())
+		{
+			const Node &node = m_nodes[index];
+			const float area = surfaceArea(node.bmin, node.bmax);
+			const float combined_area = surfaceArea(glm::min(node.bmin, leaf_min), glm::max(node.bmax, leaf_max));
+
+			//Cost of creating a new parent for this node and the new leaf
+			const float cost = 2.0f * combined_area;
+			//Minimum cost of pushing the leaf further down the tree
+			const float inheritance_cost = 2.0f * (combined_area - area);
+
+			auto descend_cost = [&](int child) -> float
+			{
+				const Node &c = m_nodes[child];
+				float enlarged = surfaceArea(glm::min(c.bmin, leaf_min), glm::max(c.bmax, leaf_max));
+				return (c.isLeaf() ? enlarged : enlarged - surfaceArea(c.bmin, c.bmax)) + inheritance_cost;
+			};
+			const float cost1 = descend_cost(node.child1);
+			const float cost2 = descend_cost(node.child2);
+
+			if (cost < cost1 && cost < cost2)
+				break;
+			index = (cost1 < cost2) ? node.child1 : node.child2;
+		}
+		const int sibling = index;
+
+		//New parent of the sibling and the leaf
+		const int old_parent = m_nodes[sibling].parent;
+		const int new_parent = allocateNode();
+		m_nodes[new_parent].parent = old_parent;
+		m_nodes[new_parent].child1 = sibling;
+		m_nodes[new_parent].child2 = leaf;
+		m_nodes[sibling].parent = new_parent;
+		m_nodes[leaf].parent = new_parent;
+		if (old_parent != -1)
+		{
+			if (m_nodes[old_parent].child1 == sibling)
+				m_nodes[old_parent].child1 = new_parent;
+			else
+				m_nodes[old_parent].child2 = new_parent;
+		}
+		else
+		{
+			m_root = new_parent;
+		}
+
+		//Walk back up the tree fixing the heights and AABBs
+		refit(new_parent);
+	}
+
+	void TRSceneBVH::removeLeaf(int leaf)
+	{
+		if (leaf == m_root)
+		{
+			m_root = -1;
+			return;
+		}
+
+		const int parent = m_nodes[leaf].parent;
+		const int grand_parent = m_nodes[parent].parent;
+		const int sibling = (m_nodes[parent].child1 == leaf) ? m_nodes[parent].child2 : m_nodes[parent].child1;
+
+		//The sibling takes the place of the parent
+		if (grand_parent != -1)
+		{
+			if (m_nodes[grand_parent].child1 == parent)
+				m_nodes[grand_parent].child1 = sibling;
+			else
+				m_nodes[grand_parent].child2 = sibling;
+			m_nodes[sibling].parent = grand_parent;
+			freeNode(parent);
+			refit(grand_parent);
+		}
+		else
+		{
+			m_root = sibling;
+			m_nodes[sibling].parent = -1;
+			freeNode(parent);
+		}
+	}
+
+	void TRSceneBVH::refit(int node)
+	{
+		int index = node;
+		while (index != -1)
+		{
+			index = balance(index);
+
+			Node &n = m_nodes[index];
+			const Node &c1 = m_nodes[n.child1];
+			const Node &c2 = m_nodes[n.child2];
+			n.height = 1 + std::max(c1.height, c2.height);
+			n.bmin = glm::min(c1.bmin, c2.bmin);
+			n.bmax = glm::max(c1.bmax, c2.bmax);
+
+			index = n.parent;
+		}
+	}
+
+	int TRSceneBVH::balance(int iA)
+	{
+		//Tree rotation if one child is higher than the other one by 2 or more
+		Node &A = m_nodes[iA];
+		if (A.isLeaf() || A.height < 2)
+			return iA;
+
+		const int iB = A.child1;
+		const int iC = A.child2;
+		Node &B = m_nodes[iB];
+		Node &C = m_nodes[iC];
+		const int diff = C.height - B.height;
+
+		auto replace_child = [&](int parent, int from, int to)
+		{
+			if (parent == -1)
+				m_root = to;
+			else if (m_nodes[parent].child1 == from)
+				m_nodes[parent].child1 = to;
+			else
+				m_nodes[parent].child2 = to;
+		};
+
+		//Rotate C up
+		if (diff > 1)
+		{
+			const int iF = C.child1;
+			const int iG = C.child2;
+			Node &F = m_nodes[iF];
+			Node &G = m_nodes[iG];
+
+			C.child1 = iA;
+			C.parent = A.parent;
+			A.parent = iC;
+			replace_child(C.parent, iA, iC);
+
+			//The higher grandchild stays under C, the other one goes to A
+			const int iKeep = (F.height > G.height) ? iF : iG;
+			const int iMove = (F.height > G.height) ? iG : iF;
+			Node &keep = m_nodes[iKeep];
+			Node &move = m_nodes[iMove];
+			C.child2 = iKeep;
+			A.child2 = iMove;
+			move.parent = iA;
+			A.bmin = glm::min(B.bmin, move.bmin);
+			A.bmax = glm::max(B.bmax, move.bmax);
+			A.height = 1 + std::max(B.height, move.height);
+			C.bmin = glm::min(A.bmin, keep.bmin);
+			C.bmax = glm::max(A.bmax, keep.bmax);
+			C.height = 1 + std::max(A.height, keep.height);
+			return iC;
+		}
+
+		//Rotate B up
+		if (diff < -1)
+		{
+			const int iD = B.child1;
+			const int iE = B.child2;
+			Node &D = m_nodes[iD];
+			Node &E = m_nodes[iE];
+
+			B.child1 = iA;
+			B.parent = A.parent;
+			A.parent = iB;
+			replace_child(B.parent, iA, iB);
+
+			const int iKeep = (D.height > E.height) ? iD : iE;
+			const int iMove = (D.height > E.height) ? iE : iD;
+			Node &keep = m_nodes[iKeep];
+			Node &move = m_nodes[iMove];
+			B.child2 = iKeep;
+			A.child1 = iMove;
+			move.parent = iA;
+			A.bmin = glm::min(C.bmin, move.bmin);
+			A.bmax = glm::max(C.bmax, move.bmax);
+			A.height = 1 + std::max(C.height, move.height);
+			B.bmin = glm::min(A.bmin, keep.bmin);
+			B.bmax = glm::max(A.bmax, keep.bmax);
+			B.height = 1 + std::max(A.height, keep.height);
+			return iB;
+		}
+
+		return iA;
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef TRSCENEBVH_H
+#define TRSCENEBVH_H
+
+#include <vector>
+#include <memory>
+
+#include "glm/glm.hpp"
+
+namespace TinyRenderer
+{
+	/**
+	 * @projectName   TinyRenderer
+	 * @brief         Dynamic bounding volume hierarchy over world space AABBs of the drawables.
+	 *                The leaves keep enlarged AABBs so that small movements don't touch the tree,
+	 *                the tree is kept balanced with rotations as the leaves are inserted and removed.
+	 */
+	class TRSceneBVH final
+	{
+	public:
+		typedef std::shared_ptr<TRSceneBVH> ptr;
+
+		// ctor/dtor.
+		TRSceneBVH() = default;
+		~TRSceneBVH() = default;
+
+		//Leaf management, a proxy is the leaf node index
+		int createProxy(const glm::vec3 &bmin, const glm::vec3 &bmax, int userData);
+		void destroyProxy(int proxy);
+		//Note: return true if the leaf was reinserted, i.e., the new AABB is out of the enlarged one
+		bool moveProxy(int proxy, const glm::vec3 &bmin, const glm::vec3 &bmax);
+		int getUserData(int proxy) const { return m_nodes[proxy].userData; }
+
+		void clear();
+
+		//Collect the user data of the leaves inside or intersecting the view frustum
+		//Note: the frustum planes are extracted from the view projection matrix, the results are appended.
+		void queryFrustum(const glm::mat4 &viewProject, std::vector<int> &results) const;
+
+		int getHeight() const { return m_root == -1 ? 0 : m_nodes[m_root].height; }
+
+	private:
+		struct Node
+		{
+			glm::vec3 bmin, bmax;
+			int parent = -1;    //Next free node if the node is in the free list
+			int child1 = -1;
+			int child2 = -1;
+			int height = -1;    //0 for leaves, -1 for free nodes
+			int userData = -1;
+
+			bool isLeaf() const { return child1 == -1; }
+		};
+
+		int allocateNode();
+		void freeNode(int node);
+
+		void insertLeaf(int leaf);
+		void removeLeaf(int leaf);
+		int balance(int node);
+		void refit(int node);
+
+		static float surfaceArea(const glm::vec3 &bmin, const glm::vec3 &bmax)
+		{
+			glm::vec3 d = bmax - bmin;
+			return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+		}
+
+	private:
+		std::vector<Node> m_nodes;
+		int m_root = -1;
+		int m_free_list = -1;
+	};
+}
+
+#endif
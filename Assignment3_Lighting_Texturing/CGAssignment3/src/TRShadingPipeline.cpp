@@ -1,7 +1,11 @@
 #include "TRShadingPipeline.h"
+#include "TRDrawableMesh.h"
 
+#include <cmath>
+#include <cassert>
 #include <algorithm>
 #include <iostream>
+#include <type_traits>
 
 namespace TinyRenderer
 {
@@ -18,6 +22,7 @@ namespace TinyRenderer
 		result.col = (1.0f - frac) * v0.col + frac * v1.col;
 		result.nor = (1.0f - frac) * v0.nor + frac * v1.nor;
 		result.tex = (1.0f - frac) * v0.tex + frac * v1.tex;
+		result.duv = glm::vec4(0.0f);
 		result.cpos = (1.0f - frac) * v0.cpos + frac * v1.cpos;
 		result.spos.x = (1.0f - frac) * v0.spos.x + frac * v1.spos.x;
 		result.spos.y = (1.0f - frac) * v0.spos.y + frac * v1.spos.y;
@@ -38,6 +43,7 @@ namespace TinyRenderer
 		result.col = w.x * v0.col + w.y * v1.col + w.z * v2.col;
 		result.nor = w.x * v0.nor + w.y * v1.nor + w.z * v2.nor;
 		result.tex = w.x * v0.tex + w.y * v1.tex + w.z * v2.tex;
+		result.duv = glm::vec4(0.0f);
 		result.cpos = w.x * v0.cpos + w.y * v1.cpos + w.z * v2.cpos;
 		result.spos.x = w.x * v0.spos.x + w.y * v1.spos.x + w.z * v2.spos.x;
 		result.spos.y = w.x * v0.spos.y + w.y * v1.spos.y + w.z * v2.spos.y;
@@ -72,185 +78,67 @@ namespace TinyRenderer
 		v.col = v.col * w;
 	}
 
-	//----------------------------------------------TRShadingPipeline----------------------------------------------
+	//----------------------------------------------FragmentSpan----------------------------------------------
 
-	std::vector<TRTexture2D::ptr> TRShadingPipeline::m_global_texture_units = {};
-	std::vector<TRPointLight> TRShadingPipeline::m_point_lights = {};
-	std::vector<TRSpotLight> TRShadingPipeline::m_spot_lights = {};
-	glm::vec3 TRShadingPipeline::m_viewer_pos = glm::vec3(0.0f);
+	constexpr int TRShadingPipeline::FragmentSpan::max_width;
 
-	void TRShadingPipeline::rasterize_wire(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
+	void TRShadingPipeline::FragmentSpan::aftPrespCorrection()
 	{
-		//Draw each line step by step
-		rasterize_wire_aux(v0, v1, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v1, v2, screen_width, screene_height, rasterized_points);
-		rasterize_wire_aux(v0, v2, screen_width, screene_height, rasterized_points);
-	}
-
-	void TRShadingPipeline::rasterize_fill_edge_function(
-		const VertexData &v0,
-		const VertexData &v1,
-		const VertexData &v2,
-		const unsigned int &screen_width,
-		const unsigned int &screene_height,
-		std::vector<VertexData> &rasterized_points)
-	{
-		VertexData v[] = { v0, v1, v2 };
-		//Edge-equations rasterization algorithm
-		glm::ivec2 bounding_min;
-		glm::ivec2 bounding_max;
-		bounding_min.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), 0);
-		bounding_min.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), 0);
-		bounding_max.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), (int)screen_width - 1);
-		bounding_max.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), (int)screene_height - 1);
-
-		//Adjust the order
+		//pw stores 1/w
+		for (unsigned int m = mask; m != 0; m &= m - 1)
 		{
-			auto e1 = v1.spos - v0.spos;
-			auto e2 = v2.spos - v0.spos;
-			int orient = e1.x * e2.y - e1.y * e2.x;
-			if (orient > 0)
-			{
-				std::swap(v[1], v[2]);
-			}
+			const int i = TRBitScanForward(m);
+			const float w = 1.0f / pw[i];
+			px[i] *= w; py[i] *= w; pz[i] *= w;
+			u[i] *= w; v[i] *= w;
+			//Quotient rule: d(u) = d((u/w) / (1/w)) = (d(u/w) - u * d(1/w)) * w
+			dudx[i] = (tex_gradient.x - u[i] * w_gradient.x) * w;
+			dvdx[i] = (tex_gradient.y - v[i] * w_gradient.x) * w;
+			dudy[i] = (tex_gradient.z - u[i] * w_gradient.y) * w;
+			dvdy[i] = (tex_gradient.w - v[i] * w_gradient.y) * w;
+			nx[i] *= w; ny[i] *= w; nz[i] *= w;
+			cr[i] *= w; cg[i] *= w; cb[i] *= w;
 		}
-
-		//Accelerated Half-Space Triangle Rasterization
-		//Refs:Mileff P, Nehz K, Dudra J. Accelerated half-space triangle rasterization[J].
-		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236. http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
-
-		const glm::ivec2 &A = v[0].spos;
-		const glm::ivec2 &B = v[1].spos;
-		const glm::ivec2 &C = v[2].spos;
-
-		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
-		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
-		const int K01 = A.x * B.y - A.y * B.x;
-		const int K02 = B.x * C.y - B.y * C.x;
-		const int K03 = C.x * A.y - C.y * A.x;
-
-		int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
-		int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
-		int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
-
-		//Degenerated to a line or a point
-		if (F01 + F02 + F03 == 0)
-			return;
-
-		const float one_div_delta = 1.0f / (F01 + F02 + F03);
-
-		//Top left fill rule
-		int E1_t = (((B.y > A.y) || (A.y == B.y && A.x > B.x)) ? 0 : 0);
-		int E2_t = (((C.y > B.y) || (B.y == C.y && B.x > C.x)) ? 0 : 0);
-		int E3_t = (((A.y > C.y) || (C.y == A.y && C.x > A.x)) ? 0 : 0);
-
-		int Cy1 = F01, Cy2 = F02, Cy3 = F03;
-		for (int y = bounding_min.y; y <= bounding_max.y; ++y)
-		{
-			int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
-			for (int x = bounding_min.x; x <= bounding_max.x; ++x)
-			{
-				int E1 = Cx1 + E1_t, E2 = Cx2 + E2_t, E3 = Cx3 + E3_t;
-				//Counter-clockwise winding order
-				if (E1 <= 0 && E2 <= 0 && E3 <= 0)
-				{
-					glm::vec3 uvw(Cx2 * one_div_delta, Cx3 * one_div_delta, Cx1 * one_div_delta);
-					auto rasterized_point = TRShadingPipeline::VertexData::barycentricLerp(v[0], v[1], v[2], uvw);
-					rasterized_point.spos = glm::ivec2(x, y);
-					rasterized_points.push_back(rasterized_point);
-				}
-				Cx1 += I01; Cx2 += I02; Cx3 += I03;
-			}
-			Cy1 += J01; Cy2 += J02; Cy3 += J03;
-		}
-
 	}
 
-	void TRShadingPipeline::rasterize_wire_aux(
-		const VertexData &from,
-		const VertexData &to,
-		const unsigned int &screen_width,
-		const unsigned int &screen_height,
-		std::vector<VertexData> &rasterized_points)
-	{
-		//Bresenham line rasterization
-
-		int dx = to.spos.x - from.spos.x;
-		int dy = to.spos.y - from.spos.y;
-		int stepX = 1, stepY = 1;
+	//----------------------------------------------TriangleSetup----------------------------------------------
 
-		// judge the sign
-		if (dx < 0)
-		{
-			stepX = -1;
-			dx = -dx;
-		}
-		if (dy < 0)
-		{
-			stepY = -1;
-			dy = -dy;
-		}
+	bool TRShadingPipeline::TriangleSetup::setup(const VertexData &v0, const VertexData &v1, const VertexData &v2)
+	{
+		const glm::ivec2 &A = v0.spos;
+		const glm::ivec2 &B = v1.spos;
+		const glm::ivec2 &C = v2.spos;
+
+		//Twice the signed area
+		int area = (A.x * B.y - A.y * B.x) + (B.x * C.y - B.y * C.x) + (C.x * A.y - C.y * A.x);
+		if (area == 0)
+			return false;
+
+		origin = A;
+		one_div_area = 1.0f / area;
+
+		//Edge functions (I, J) of the weights of v1 and v2
+		const float I1 = static_cast<float>(C.y - A.y), J1 = static_cast<float>(A.x - C.x);
+		const float I2 = static_cast<float>(A.y - B.y), J2 = static_cast<float>(B.x - A.x);
+
+		pos = makePlane(v0.pos, v1.pos, v2.pos, I1, I2, J1, J2, one_div_area);
+		col = makePlane(v0.col, v1.col, v2.col, I1, I2, J1, J2, one_div_area);
+		nor = makePlane(v0.nor, v1.nor, v2.nor, I1, I2, J1, J2, one_div_area);
+		tex = makePlane(v0.tex, v1.tex, v2.tex, I1, I2, J1, J2, one_div_area);
+		depth = makePlane(v0.cpos.z, v1.cpos.z, v2.cpos.z, I1, I2, J1, J2, one_div_area);
+		TBN = v0.TBN;
+
+		return true;
+	}
 
-		int d2x = 2 * dx, d2y = 2 * dy;
-		int d2y_minus_d2x = d2y - d2x;
-		int sx = from.spos.x;
-		int sy = from.spos.y;
+	//----------------------------------------------TRShadingPipeline----------------------------------------------
 
-		// slope < 1.
-		if (dy <= dx)
-		{
-			int flag = d2y - dx;
-			for (int i = 0; i <= dx; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dx);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x <= screen_width && mid.spos.y >= 0 && mid.spos.y <= screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sx += stepX;
-				if (flag <= 0)
-				{
-					flag += d2y;
-				}
-				else
-				{
-					sy += stepY;
-					flag += d2y_minus_d2x;
-				}
-			}
-		}
-		// slope > 1.
-		else
-		{
-			int flag = d2x - dy;
-			for (int i = 0; i <= dy; ++i)
-			{
-				auto mid = VertexData::lerp(from, to, static_cast<float>(i) / dy);
-				mid.spos = glm::ivec2(sx, sy);
-				if (mid.spos.x >= 0 && mid.spos.x < screen_width && mid.spos.y >= 0 && mid.spos.y < screen_height)
-				{
-					rasterized_points.push_back(mid);
-				}
-				sy += stepY;
-				if (flag <= 0)
-				{
-					flag += d2x;
-				}
-				else
-				{
-					sx += stepX;
-					flag -= d2y_minus_d2x;
-				}
-			}
-		}
-	}
+	std::vector<TRTexture2D::ptr> TRShadingPipeline::m_global_texture_units = {};
+	std::vector<TRPointLight> TRShadingPipeline::m_point_lights = {};
+	std::vector<TRSpotLight> TRShadingPipeline::m_spot_lights = {};
+	TRLightGrid TRShadingPipeline::m_light_grid;
+	glm::vec3 TRShadingPipeline::m_viewer_pos = glm::vec3(0.0f);
+	bool TRShadingPipeline::m_fast_math = false;
 
 	int TRShadingPipeline::upload_texture_2D(TRTexture2D::ptr tex)
 	{
@@ -296,6 +184,46 @@ namespace TinyRenderer
 		return m_global_texture_units[id]->sample(uv);
 	}
 
+	glm::vec4 TRShadingPipeline::texture2D(const unsigned int &id, const glm::vec2 &uv, const glm::vec4 &duv)
+	{
+		if (id >= m_global_texture_units.size())
+			return glm::vec4(0.0f);
+		return m_global_texture_units[id]->sample(uv, duv);
+	}
+
+
+	void TRShadingPipeline::vertexShaderBatch(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			out[i].pos = vertices.position(first + i);
+			out[i].col = vertices.color(first + i);
+			out[i].nor = vertices.normal(first + i);
+			out[i].tex = vertices.texcoord(first + i);
+			vertexShader(out[i]);
+		}
+	}
+
+	void TRShadingPipeline::fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors)
+	{
+		VertexData data;
+		for (unsigned int m = span.mask; m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			span.fragment(i, data);
+			fragmentShader(data, fragColors[i]);
+		}
+	}
+
+	void TRShadingPipeline::faceTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2,
+		const glm::vec3 &tangent, const glm::vec3 &bitangent) const
+	{
+		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * tangent);
+		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * bitangent);
+		v0.TBN = glm::mat3(T, B, v0.nor);
+		v1.TBN = glm::mat3(T, B, v1.nor);
+		v2.TBN = glm::mat3(T, B, v2.nor);
+	}
 
 	//----------------------------------------------TRDefaultShadingPipeline----------------------------------------------
 
@@ -305,10 +233,77 @@ namespace TinyRenderer
 		vertex.pos = m_model_matrix * glm::vec4(vertex.pos.x, vertex.pos.y, vertex.pos.z, 1.0f);
 		vertex.nor = glm::normalize(m_inv_trans_model_matrix * vertex.nor);
 		vertex.cpos = m_view_project_matrix * vertex.pos;
+	}
 
-		glm::vec3 T = glm::normalize(m_inv_trans_model_matrix * m_tangent);
-		glm::vec3 B = glm::normalize(m_inv_trans_model_matrix * m_bitangent);
-		vertex.TBN = glm::mat3(T, B, vertex.nor);
+	void TRDefaultShadingPipeline::vertexShaderBatchDefault(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out)
+	{
+		size_t i = 0;
+#if defined(TR_SIMD_SSE2)
+		//Four vertices at a time straight from the position and normal streams
+		//Note: the operations are in the same order as the glm ones of vertexShader, so the results are the same.
+		const glm::mat4 &M = m_model_matrix;
+		const glm::mat4 &VP = m_view_project_matrix;
+		const glm::mat3 &N = m_inv_trans_model_matrix;
+		const bool has_normals = vertices.hasNormals();
+		for (; i + 4 <= count; i += 4)
+		{
+			const size_t v = first + i;
+			const __m128 x = _mm_loadu_ps(&vertices.vx[v]);
+			const __m128 y = _mm_loadu_ps(&vertices.vy[v]);
+			const __m128 z = _mm_loadu_ps(&vertices.vz[v]);
+
+			//Local space -> World space -> Camera space -> Project space
+			__m128 pos[4], cpos[4];
+			for (int r = 0; r < 4; ++r)
+			{
+				pos[r] = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(M[0][r]), x), _mm_mul_ps(_mm_set1_ps(M[1][r]), y)),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(M[2][r]), z), _mm_set1_ps(M[3][r])));
+			}
+			for (int r = 0; r < 4; ++r)
+			{
+				cpos[r] = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(VP[0][r]), pos[0]), _mm_mul_ps(_mm_set1_ps(VP[1][r]), pos[1])),
+					_mm_add_ps(_mm_mul_ps(_mm_set1_ps(VP[2][r]), pos[2]), _mm_mul_ps(_mm_set1_ps(VP[3][r]), pos[3])));
+			}
+
+			//Normal transformation and normalization
+			const __m128 nx = has_normals ? _mm_loadu_ps(&vertices.vnx[v]) : _mm_setzero_ps();
+			const __m128 ny = has_normals ? _mm_loadu_ps(&vertices.vny[v]) : _mm_setzero_ps();
+			const __m128 nz = has_normals ? _mm_loadu_ps(&vertices.vnz[v]) : _mm_setzero_ps();
+			__m128 nor[3];
+			for (int r = 0; r < 3; ++r)
+			{
+				nor[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(N[0][r]), nx), _mm_mul_ps(_mm_set1_ps(N[1][r]), ny)),
+					_mm_mul_ps(_mm_set1_ps(N[2][r]), nz));
+			}
+			const __m128 len2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nor[0], nor[0]), _mm_mul_ps(nor[1], nor[1])), _mm_mul_ps(nor[2], nor[2]));
+			const __m128 inv_len = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(len2));
+
+			//Back to one VertexData per vertex
+			alignas(16) float pos_lanes[4][4], cpos_lanes[4][4], nor_lanes[3][4];
+			for (int r = 0; r < 4; ++r)
+			{
+				_mm_store_ps(pos_lanes[r], pos[r]);
+				_mm_store_ps(cpos_lanes[r], cpos[r]);
+			}
+			for (int r = 0; r < 3; ++r)
+			{
+				_mm_store_ps(nor_lanes[r], _mm_mul_ps(nor[r], inv_len));
+			}
+			for (int k = 0; k < 4; ++k)
+			{
+				VertexData &vertex = out[i + k];
+				vertex.pos = glm::vec4(pos_lanes[0][k], pos_lanes[1][k], pos_lanes[2][k], pos_lanes[3][k]);
+				vertex.cpos = glm::vec4(cpos_lanes[0][k], cpos_lanes[1][k], cpos_lanes[2][k], cpos_lanes[3][k]);
+				vertex.nor = glm::vec3(nor_lanes[0][k], nor_lanes[1][k], nor_lanes[2][k]);
+				vertex.col = vertices.color(v + k);
+				vertex.tex = vertices.texcoord(v + k);
+			}
+		}
+#endif
+		//The rest one by one
+		TRShadingPipeline::vertexShaderBatch(vertices, first + i, count - i, out + i);
 	}
 
 	void TRDefaultShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
@@ -326,7 +321,17 @@ namespace TinyRenderer
 
 		if (m_diffuse_tex_id != -1)
 		{
-			fragColor = texture2D(m_diffuse_tex_id, data.tex);
+			fragColor = texture2D(m_diffuse_tex_id, data.tex, data.duv);
+		}
+	}
+
+	void TRTextureShadingPipeline::fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors)
+	{
+		for (unsigned int m = span.mask; m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			fragColors[i] = (m_diffuse_tex_id != -1) ? texture2D(m_diffuse_tex_id, glm::vec2(span.u[i], span.v[i]),
+				glm::vec4(span.dudx[i], span.dvdx[i], span.dudy[i], span.dvdy[i])) : glm::vec4(m_ke, 1.0f);
 		}
 	}
 
@@ -334,29 +339,128 @@ namespace TinyRenderer
 
 	void TRPhongShadingPipeline::fragmentShader(const VertexData &data, glm::vec4 &fragColor)
 	{
-		fragColor = glm::vec4(0.0f);
+		//Forward shading is the two passes of the deferred shading in a row
+		TRGBufferTexel texel;
+		surfaceShader(data, texel);
+		lightingShader(texel, fragColor);
+	}
 
+	void TRPhongShadingPipeline::surfaceShader(const VertexData &data, TRGBufferTexel &texel)
+	{
 		//Fetch the corresponding color 
-		glm::vec3 amb_color, dif_color, spe_color, glow_color;
-		amb_color = dif_color = (m_diffuse_tex_id != -1) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex)) : m_kd;
-		spe_color = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex)) : m_ks;
-		glow_color = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex)) : m_ke;
+		texel.albedo = (m_diffuse_tex_id != -1) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex, data.duv)) : m_kd;
+		texel.specular = (m_specular_tex_id != -1) ? glm::vec3(texture2D(m_specular_tex_id, data.tex, data.duv)) : m_ks;
+		texel.emission = (m_glow_tex_id != -1) ? glm::vec3(texture2D(m_glow_tex_id, data.tex, data.duv)) : m_ke;
+		texel.position = glm::vec3(data.pos);
+		texel.normal = data.nor;
+		texel.tint = glm::vec3(1.0f);
+		texel.shininess = m_shininess;
+		texel.lit = m_lighting_enable;
+	}
 
+	void TRPhongShadingPipeline::lightingShader(const TRGBufferTexel &texel, glm::vec4 &fragColor) const
+	{
 		//No lighting
-		if (!m_lighting_enable)
+		if (!texel.lit)
 		{
-			fragColor = glm::vec4(glow_color, 1.0f);
+			fragColor = glm::vec4(texel.emission, 1.0f);
 			return;
 		}
 
+		//Note: a texel without the specular color is shaded without the highlights, which adds nothing anyway
+		const bool specular = texel.specular != glm::vec3(0.0f);
+		if (m_light_grid.isEnabled())
+			specular ? calcLighting<true, true>(texel, fragColor) : calcLighting<true, false>(texel, fragColor);
+		else
+			specular ? calcLighting<false, true>(texel, fragColor) : calcLighting<false, false>(texel, fragColor);
+	}
+
+	int TRPhongShadingPipeline::getFragmentShaderVariant() const
+	{
+		//Without lighting only the glow color is used
+		if (!m_lighting_enable)
+			return (m_glow_tex_id != -1) ? static_cast<int>(GLOW_MAP) : 0;
+
+		int variant = LIGHTING;
+		variant |= (m_diffuse_tex_id != -1) ? static_cast<int>(DIFFUSE_MAP) : 0;
+		variant |= (m_specular_tex_id != -1) ? static_cast<int>(SPECULAR_MAP) : 0;
+		variant |= (m_glow_tex_id != -1) ? static_cast<int>(GLOW_MAP) : 0;
+		variant |= (m_specular_tex_id != -1 || m_ks != glm::vec3(0.0f)) ? static_cast<int>(SPECULAR) : 0;
+		variant |= m_light_grid.isEnabled() ? static_cast<int>(LIGHT_CULLING) : 0;
+		return variant;
+	}
+
+	namespace
+	{
+		typedef TRPhongShadingPipeline::VariantShaders VariantShaders;
+
+		template<unsigned int Features>
+		void fillVariantShaders(VariantShaders *table, std::true_type)
+		{
+			table[Features].fragmentShader = &TRPhongShadingPipeline::fragmentShaderVariant<Features>;
+			table[Features].surfaceShader = &TRPhongShadingPipeline::surfaceShaderVariant<Features>;
+			table[Features].fragmentShaderSpan = &TRPhongShadingPipeline::fragmentShaderSpanVariant<Features>;
+		}
+
+		template<unsigned int Features>
+		void fillVariantShaders(VariantShaders */*table*/, std::false_type) {}
+
+		template<unsigned int Count>
+		struct VariantShadersFiller
+		{
+			static void fill(VariantShaders *table)
+			{
+				VariantShadersFiller<Count - 1>::fill(table);
+				fillVariantShaders<Count - 1>(table,
+					std::integral_constant<bool, TRPhongShadingPipeline::isReachableVariant(Count - 1)>());
+			}
+		};
+
+		template<>
+		struct VariantShadersFiller<0>
+		{
+			static void fill(VariantShaders */*table*/) {}
+		};
+
+		struct VariantShadersTable
+		{
+			VariantShaders shaders[TRPhongShadingPipeline::NUM_VARIANTS] = {};
+			VariantShadersTable() { VariantShadersFiller<TRPhongShadingPipeline::NUM_VARIANTS>::fill(shaders); }
+		};
+	}
+
+	const TRPhongShadingPipeline::VariantShaders &TRPhongShadingPipeline::getVariantShaders(int variant)
+	{
+		static const VariantShadersTable table;
+		assert(variant >= 0 && variant < static_cast<int>(NUM_VARIANTS) && table.shaders[variant].fragmentShaderSpan != nullptr);
+		return table.shaders[variant];
+	}
+
+	template<bool LightCulling, bool Specular>
+	void TRPhongShadingPipeline::calcLighting(const TRGBufferTexel &texel, glm::vec4 &fragColor) const
+	{
+		fragColor = glm::vec4(0.0f);
+
+		const glm::vec3 &amb_color = texel.albedo, &dif_color = texel.albedo;
+		const glm::vec3 &spe_color = texel.specular, &glow_color = texel.emission;
+
 		//Calculate the lighting
-		glm::vec3 fragPos = glm::vec3(data.pos);
-		glm::vec3 normal = glm::normalize(data.nor);
+		glm::vec3 fragPos = texel.position;
+		glm::vec3 normal = glm::normalize(texel.normal);
 		glm::vec3 viewDir = glm::normalize(m_viewer_pos - fragPos);
 		// printf("%d", m_spot_lights.size());
-		for (size_t i = 0; i < m_point_lights.size(); ++i)
+		//Only the lights of the cluster if the light culling is enabled
+		const bool light_culling = LightCulling;
+		const unsigned int *cluster_begin = nullptr, *cluster_end = nullptr;
+		if (light_culling)
 		{
-			const auto &light = m_point_lights[i];
+			m_light_grid.lookup(fragPos, cluster_begin, cluster_end);
+		}
+		const size_t num_lights = light_culling ? cluster_end - cluster_begin : m_point_lights.size();
+		for (size_t i = 0; i < num_lights; ++i)
+		{
+			const size_t light_index = light_culling ? cluster_begin[i] : i;
+			const auto &light = m_point_lights[light_index];
 			glm::vec3 lightDir = glm::normalize(light.lightPos - fragPos);
 			// float theta = glm::dot(lightDir, normalize(-light.direction));
 			// float epsilon = light.cutOff - light.outerCutOff;
@@ -368,6 +472,11 @@ namespace TinyRenderer
 			float distance = glm::length(light.lightPos - fragPos);
 			attenuation = 1.0 / (light.attenuation.x + light.attenuation.y * distance +
 				light.attenuation.z * (distance * distance));
+			if (light_culling)
+			{
+				//Fade out to 0 at the effective radius
+				attenuation = glm::max(attenuation - m_light_grid.getAttenuationCutoff(light_index), 0.0f);
+			}
 
 			// 
 			ambient = glm::vec3(light.lightColor.x * amb_color.x , light.lightColor.y * amb_color.y , light.lightColor.z * amb_color.z);
@@ -382,9 +491,13 @@ namespace TinyRenderer
 			// float cof = glm::pow(glm::dot(r, viewDir) , m_shininess);
 			// specular = glm::vec3(light.lightColor.x * spe_color.x, light.lightColor.y * spe_color.y, light.lightColor.z * spe_color.z) * cof;
 			// bling-phong
-			glm::vec3 halfwayDir = glm::normalize(lightDir + viewDir);
-			float cof = glm::pow(glm::max(glm::dot(normal, halfwayDir), 0.0f), m_shininess);
-			specular = glm::vec3(light.lightColor.x * spe_color.x, light.lightColor.y * spe_color.y, light.lightColor.z * spe_color.z) * cof;
+			specular = glm::vec3(0.0f);
+			if (Specular)
+			{
+				glm::vec3 halfwayDir = glm::normalize(lightDir + viewDir);
+				float cof = glm::pow(glm::max(glm::dot(normal, halfwayDir), 0.0f), texel.shininess);
+				specular = glm::vec3(light.lightColor.x * spe_color.x, light.lightColor.y * spe_color.y, light.lightColor.z * spe_color.z) * cof;
+			}
 			/*ambient = amb_color;*/
 			// diffuse = dif_color;
 			// specular = spe_color;
@@ -411,6 +524,240 @@ namespace TinyRenderer
 		}
 	}
 
+	void TRPhongShadingPipeline::fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors)
+	{
+		//The features of the current settings, branched on once per span
+		const unsigned int features = static_cast<unsigned int>(getFragmentShaderVariant());
+		SurfaceSpan surface;
+		fetchSurfaceSpan(span, features, surface);
+		shadeSurfaceSpan(surface, span.mask, features, fragColors);
+	}
+
+	void TRPhongShadingPipeline::shadeSurfaceSpan(const SurfaceSpan &surface, unsigned int mask,
+		unsigned int features, glm::vec4 *fragColors) const
+	{
+		//No lighting
+		if (!(features & LIGHTING))
+		{
+			for (unsigned int m = mask; m != 0; m &= m - 1)
+			{
+				const int i = TRBitScanForward(m);
+				fragColors[i] = glm::vec4(surface.er[i], surface.eg[i], surface.eb[i], 1.0f);
+			}
+			return;
+		}
+
+		const bool specular = (features & SPECULAR) != 0;
+		if (features & LIGHT_CULLING)
+			specular ? calcLightingSpan<true, true>(surface, mask, fragColors) : calcLightingSpan<true, false>(surface, mask, fragColors);
+		else
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+			specular ? calcLightingSpanSimd<true>(surface, mask, fragColors) : calcLightingSpanSimd<false>(surface, mask, fragColors);
+#else
+			specular ? calcLightingSpan<false, true>(surface, mask, fragColors) : calcLightingSpan<false, false>(surface, mask, fragColors);
+#endif
+	}
+
+	template<bool LightCulling, bool Specular>
+	void TRPhongShadingPipeline::calcLightingSpan(const SurfaceSpan &surface, unsigned int mask, glm::vec4 *fragColors) const
+	{
+		//Note: the same operations in the same order as calcLighting (glm::normalize is v * (1 / sqrt(dot(v, v)))),
+		//      so every lane gets exactly the color of the single fragment shader.
+		constexpr int N = FragmentSpan::max_width;
+		float nx[N], ny[N], nz[N];    //Normal
+		float vx[N], vy[N], vz[N];    //View direction
+		float r[N], g[N], b[N];       //Accumulated color
+		for (unsigned int m = mask; m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			float inv_len = 1.0f / std::sqrt(surface.nx[i] * surface.nx[i] + surface.ny[i] * surface.ny[i] + surface.nz[i] * surface.nz[i]);
+			nx[i] = surface.nx[i] * inv_len; ny[i] = surface.ny[i] * inv_len; nz[i] = surface.nz[i] * inv_len;
+			vx[i] = m_viewer_pos.x - surface.px[i]; vy[i] = m_viewer_pos.y - surface.py[i]; vz[i] = m_viewer_pos.z - surface.pz[i];
+			inv_len = 1.0f / std::sqrt(vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+			vx[i] *= inv_len; vy[i] *= inv_len; vz[i] *= inv_len;
+			r[i] = g[i] = b[i] = 0.0f;
+		}
+
+		//Blinn-Phong of a light at lane i
+		auto add_light = [&](int i, size_t light_index)
+		{
+			const auto &light = m_point_lights[light_index];
+			float lx = light.lightPos.x - surface.px[i], ly = light.lightPos.y - surface.py[i], lz = light.lightPos.z - surface.pz[i];
+			const float distance = std::sqrt(lx * lx + ly * ly + lz * lz);
+			const float inv_len = 1.0f / distance;
+			lx *= inv_len; ly *= inv_len; lz *= inv_len;
+
+			float attenuation = 1.0f / (light.attenuation.x + light.attenuation.y * distance +
+				light.attenuation.z * (distance * distance));
+			if (LightCulling)
+			{
+				attenuation = std::max(attenuation - m_light_grid.getAttenuationCutoff(light_index), 0.0f);
+			}
+
+			const float cos_theta = std::max(0.0f, nx[i] * lx + ny[i] * ly + nz[i] * lz);
+			float spe_r = 0.0f, spe_g = 0.0f, spe_b = 0.0f;
+			if (Specular)
+			{
+				float hx = lx + vx[i], hy = ly + vy[i], hz = lz + vz[i];
+				const float inv_h = 1.0f / std::sqrt(hx * hx + hy * hy + hz * hz);
+				hx *= inv_h; hy *= inv_h; hz *= inv_h;
+				const float cof = std::pow(std::max(nx[i] * hx + ny[i] * hy + nz[i] * hz, 0.0f), m_shininess);
+				spe_r = light.lightColor.x * surface.sr[i] * cof;
+				spe_g = light.lightColor.y * surface.sg[i] * cof;
+				spe_b = light.lightColor.z * surface.sb[i] * cof;
+			}
+
+			r[i] += (light.lightColor.x * surface.ar[i] + light.lightColor.x * surface.ar[i] * cos_theta + spe_r) * attenuation;
+			g[i] += (light.lightColor.y * surface.ag[i] + light.lightColor.y * surface.ag[i] * cos_theta + spe_g) * attenuation;
+			b[i] += (light.lightColor.z * surface.ab[i] + light.lightColor.z * surface.ab[i] * cos_theta + spe_b) * attenuation;
+		};
+
+		if (LightCulling)
+		{
+			//The lanes may be in different clusters
+			for (unsigned int m = mask; m != 0; m &= m - 1)
+			{
+				const int i = TRBitScanForward(m);
+				const unsigned int *cluster_begin, *cluster_end;
+				m_light_grid.lookup(glm::vec3(surface.px[i], surface.py[i], surface.pz[i]), cluster_begin, cluster_end);
+				for (const unsigned int *l = cluster_begin; l != cluster_end; ++l)
+				{
+					add_light(i, *l);
+				}
+			}
+		}
+		else
+		{
+			for (size_t l = 0; l < m_point_lights.size(); ++l)
+			{
+				for (unsigned int m = mask; m != 0; m &= m - 1)
+				{
+					add_light(TRBitScanForward(m), l);
+				}
+			}
+		}
+
+		//Emission and tone mapping
+		for (unsigned int m = mask; m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			fragColors[i] = glm::vec4(
+				1.0f - std::exp(-(r[i] + surface.er[i]) * 2.0f),
+				1.0f - std::exp(-(g[i] + surface.eg[i]) * 2.0f),
+				1.0f - std::exp(-(b[i] + surface.eb[i]) * 2.0f),
+				1.0f);
+		}
+	}
+
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+	template<bool Specular>
+	void TRPhongShadingPipeline::calcLightingSpanSimd(const SurfaceSpan &surface, unsigned int mask, glm::vec4 *fragColors) const
+	{
+		//Note: the operations of calcLightingSpan in the same order (TRMax(a, b) is std::max(b, a)), so the lanes get
+		//      the same colors. Only pow and exp have no exact vector counterparts, they are evaluated lane by lane
+		//      unless the fast math allows the approximations.
+		constexpr int W = TRFloatN::width;
+		constexpr unsigned int group_mask = (1u << W) - 1;
+		const TRFloatN zero(0.0f), one(1.0f), two(2.0f);
+		const TRFloatN shininess(m_shininess);
+		const bool fast_math = m_fast_math;
+		float tmp[W];
+		for (int g = 0; g < FragmentSpan::max_width; g += W)
+		{
+			const unsigned int lanes = (mask >> g) & group_mask;
+			if (lanes == 0)
+				continue;
+
+			const TRFloatN px = TRFloatN::load(surface.px + g), py = TRFloatN::load(surface.py + g), pz = TRFloatN::load(surface.pz + g);
+			TRFloatN nx = TRFloatN::load(surface.nx + g), ny = TRFloatN::load(surface.ny + g), nz = TRFloatN::load(surface.nz + g);
+			TRFloatN inv_len = one / TRSqrt(nx * nx + ny * ny + nz * nz);
+			nx = nx * inv_len; ny = ny * inv_len; nz = nz * inv_len;
+			TRFloatN vx = TRFloatN(m_viewer_pos.x) - px, vy = TRFloatN(m_viewer_pos.y) - py, vz = TRFloatN(m_viewer_pos.z) - pz;
+			inv_len = one / TRSqrt(vx * vx + vy * vy + vz * vz);
+			vx = vx * inv_len; vy = vy * inv_len; vz = vz * inv_len;
+
+			const TRFloatN ar = TRFloatN::load(surface.ar + g), ag = TRFloatN::load(surface.ag + g), ab = TRFloatN::load(surface.ab + g);
+			const TRFloatN sr = TRFloatN::load(surface.sr + g), sg = TRFloatN::load(surface.sg + g), sb = TRFloatN::load(surface.sb + g);
+			TRFloatN r = zero, gr = zero, b = zero;
+			for (const auto &light : m_point_lights)
+			{
+				TRFloatN lx = TRFloatN(light.lightPos.x) - px, ly = TRFloatN(light.lightPos.y) - py, lz = TRFloatN(light.lightPos.z) - pz;
+				const TRFloatN distance = TRSqrt(lx * lx + ly * ly + lz * lz);
+				const TRFloatN inv_dist = one / distance;
+				lx = lx * inv_dist; ly = ly * inv_dist; lz = lz * inv_dist;
+
+				const TRFloatN attenuation = one / (TRFloatN(light.attenuation.x) + TRFloatN(light.attenuation.y) * distance +
+					TRFloatN(light.attenuation.z) * (distance * distance));
+
+				const TRFloatN cos_theta = TRMax(nx * lx + ny * ly + nz * lz, zero);
+				const TRFloatN cr(light.lightColor.x), cg(light.lightColor.y), cb(light.lightColor.z);
+				TRFloatN spe_r = zero, spe_g = zero, spe_b = zero;
+				if (Specular)
+				{
+					TRFloatN hx = lx + vx, hy = ly + vy, hz = lz + vz;
+					const TRFloatN inv_h = one / TRSqrt(hx * hx + hy * hy + hz * hz);
+					hx = hx * inv_h; hy = hy * inv_h; hz = hz * inv_h;
+					TRFloatN cof = TRMax(zero, nx * hx + ny * hy + nz * hz);
+					if (fast_math)
+					{
+						cof = TRPow(cof, shininess);
+					}
+					else
+					{
+						cof.store(tmp);
+						for (unsigned int m = lanes; m != 0; m &= m - 1)
+						{
+							const int i = TRBitScanForward(m);
+							tmp[i] = std::pow(tmp[i], m_shininess);
+						}
+						cof = TRFloatN::load(tmp);
+					}
+					spe_r = cr * sr * cof;
+					spe_g = cg * sg * cof;
+					spe_b = cb * sb * cof;
+				}
+
+				r = r + (cr * ar + cr * ar * cos_theta + spe_r) * attenuation;
+				gr = gr + (cg * ag + cg * ag * cos_theta + spe_g) * attenuation;
+				b = b + (cb * ab + cb * ab * cos_theta + spe_b) * attenuation;
+			}
+
+			//Emission and tone mapping
+			TRFloatN hdr[3] = {
+				-(r + TRFloatN::load(surface.er + g)) * two,
+				-(gr + TRFloatN::load(surface.eg + g)) * two,
+				-(b + TRFloatN::load(surface.eb + g)) * two };
+			float ldr[3][W];
+			for (int c = 0; c < 3; ++c)
+			{
+				if (fast_math)
+				{
+					(one - TRExp(hdr[c])).store(ldr[c]);
+				}
+				else
+				{
+					hdr[c].store(ldr[c]);
+					for (unsigned int m = lanes; m != 0; m &= m - 1)
+					{
+						const int i = TRBitScanForward(m);
+						ldr[c][i] = 1.0f - std::exp(ldr[c][i]);
+					}
+				}
+			}
+			for (unsigned int m = lanes; m != 0; m &= m - 1)
+			{
+				const int i = TRBitScanForward(m);
+				fragColors[g + i] = glm::vec4(ldr[0][i], ldr[1][i], ldr[2][i], 1.0f);
+			}
+		}
+	}
+#endif
+
+	template void TRPhongShadingPipeline::calcLighting<true, true>(const TRGBufferTexel &texel, glm::vec4 &fragColor) const;
+	template void TRPhongShadingPipeline::calcLighting<true, false>(const TRGBufferTexel &texel, glm::vec4 &fragColor) const;
+	template void TRPhongShadingPipeline::calcLighting<false, true>(const TRGBufferTexel &texel, glm::vec4 &fragColor) const;
+	template void TRPhongShadingPipeline::calcLighting<false, false>(const TRGBufferTexel &texel, glm::vec4 &fragColor) const;
+
 	void TRPhongShadingPipeline::fetchFragmentColor(glm::vec3 &amb, glm::vec3 &diff, glm::vec3 &spe, const glm::vec2 &uv) const
 	{
 		amb = diff = (m_diffuse_tex_id != -1) ? glm::vec3(texture2D(m_diffuse_tex_id, uv)) : m_kd;
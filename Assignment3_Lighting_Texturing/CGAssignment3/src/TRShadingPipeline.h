@@ -3,13 +3,19 @@
 
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #include "glm/glm.hpp"
 
 #include "TRTexture2D.h"
+#include "TRFrameBuffer.h"
+#include "TRLightGrid.h"
+#include "TRSimd.h"
 
 namespace TinyRenderer
 {
+	class TRVertexAttrib;
+
 	class TRShadingPipeline
 	{
 	public:
@@ -22,6 +28,7 @@ namespace TinyRenderer
 			glm::vec3 col;  //World space color
 			glm::vec3 nor;  //World space normal
 			glm::vec2 tex;	//World space texture coordinate
+			glm::vec4 duv;  //Screen space derivatives of tex: (du/dx, dv/dx, du/dy, dv/dy), 0 if unknown
 			glm::vec4 cpos; //Clip space position
 			glm::ivec2 spos;//Screen space position
 			glm::mat3 TBN;  //Tangent, bitangent, normal matrix
@@ -35,8 +42,126 @@ namespace TinyRenderer
 			static void aftPrespCorrection(VertexData &v);
 		};
 
+		//A horizontal run of up to max_width fragments of one triangle, the varyings in SoA layout
+		//Note: lane i is pixel (x + i, y), it is only valid if bit i of the mask is set.
+		class FragmentSpan
+		{
+		public:
+			static constexpr int max_width = 8;
+
+			int x, y;
+			unsigned int mask;
+			float px[max_width], py[max_width], pz[max_width], pw[max_width];  //World space position, pw is 1/w
+			float cr[max_width], cg[max_width], cb[max_width];                 //World space color
+			float nx[max_width], ny[max_width], nz[max_width];                 //World space normal
+			float u[max_width], v[max_width];                                  //Texture coordinate
+			float dudx[max_width], dvdx[max_width];                            //Screen space derivatives of the
+			float dudy[max_width], dvdy[max_width];                            //texture coordinate
+			float depth[max_width];                                            //ndc space z
+			glm::mat3 TBN;
+			//Gradients of tex/w (du/dx, dv/dx, du/dy, dv/dy) and 1/w (dx, dy) of the triangle
+			glm::vec4 tex_gradient;
+			glm::vec2 w_gradient;
+
+			//Perspective correction of the covered lanes, the same as VertexData::aftPrespCorrection
+			//Note: the derivatives of the texture coordinate are computed here too.
+			void aftPrespCorrection();
+
+			//Single fragment of a lane, what the per-fragment shaders get
+			void fragment(int lane, VertexData &data) const
+			{
+				data.pos = glm::vec4(px[lane], py[lane], pz[lane], pw[lane]);
+				data.col = glm::vec3(cr[lane], cg[lane], cb[lane]);
+				data.nor = glm::vec3(nx[lane], ny[lane], nz[lane]);
+				data.tex = glm::vec2(u[lane], v[lane]);
+				data.duv = glm::vec4(dudx[lane], dvdx[lane], dudy[lane], dvdy[lane]);
+				data.cpos.z = depth[lane];
+				data.spos = glm::ivec2(x + lane, y);
+				data.TBN = TBN;
+			}
+		};
+
+		//Triangle setup: plane equations of the attributes, computed once per triangle
+		//Note: a(x, y) = a0 + dadx * (x - x0) + dady * (y - y0), (x0, y0) is the screen position of the first vertex.
+		//      The planes also give the screen space derivatives of the attributes.
+		class TriangleSetup
+		{
+		public:
+			template<typename T>
+			struct Plane
+			{
+				T a0, dadx, dady;
+				T at(float dx, float dy) const { return a0 + dady * dy + dadx * dx; }
+			};
+
+			glm::ivec2 origin;
+			float one_div_area;     //1 / (2 * signed area)
+			Plane<glm::vec4> pos;
+			Plane<glm::vec3> col;
+			Plane<glm::vec3> nor;
+			Plane<glm::vec2> tex;
+			Plane<float> depth;     //ndc space z
+			glm::mat3 TBN;
+
+			//Return false if the triangle is degenerated to a line or a point
+			bool setup(const VertexData &v0, const VertexData &v1, const VertexData &v2);
+
+			//Evaluate the planes at pixel (x, y)
+			float interpolateDepth(int x, int y) const
+			{
+				return depth.at(static_cast<float>(x - origin.x), static_cast<float>(y - origin.y));
+			}
+			void interpolate(int x, int y, VertexData &fragment) const
+			{
+				const float dx = static_cast<float>(x - origin.x);
+				const float dy = static_cast<float>(y - origin.y);
+				fragment.pos = pos.at(dx, dy);
+				fragment.col = col.at(dx, dy);
+				fragment.nor = nor.at(dx, dy);
+				fragment.tex = tex.at(dx, dy);
+				fragment.duv = glm::vec4(0.0f);
+				fragment.cpos.z = depth.at(dx, dy);
+				fragment.spos = glm::ivec2(x, y);
+				fragment.TBN = TBN;
+			}
+			void interpolate(int x, int y, FragmentSpan &span, int lane) const
+			{
+				const float dx = static_cast<float>(x - origin.x);
+				const float dy = static_cast<float>(y - origin.y);
+				span.px[lane] = pos.a0.x + pos.dady.x * dy + pos.dadx.x * dx;
+				span.py[lane] = pos.a0.y + pos.dady.y * dy + pos.dadx.y * dx;
+				span.pz[lane] = pos.a0.z + pos.dady.z * dy + pos.dadx.z * dx;
+				span.pw[lane] = pos.a0.w + pos.dady.w * dy + pos.dadx.w * dx;
+				span.cr[lane] = col.a0.x + col.dady.x * dy + col.dadx.x * dx;
+				span.cg[lane] = col.a0.y + col.dady.y * dy + col.dadx.y * dx;
+				span.cb[lane] = col.a0.z + col.dady.z * dy + col.dadx.z * dx;
+				span.nx[lane] = nor.a0.x + nor.dady.x * dy + nor.dadx.x * dx;
+				span.ny[lane] = nor.a0.y + nor.dady.y * dy + nor.dadx.y * dx;
+				span.nz[lane] = nor.a0.z + nor.dady.z * dy + nor.dadx.z * dx;
+				span.u[lane] = tex.a0.x + tex.dady.x * dy + tex.dadx.x * dx;
+				span.v[lane] = tex.a0.y + tex.dady.y * dy + tex.dadx.y * dx;
+				span.depth[lane] = depth.at(dx, dy);
+			}
+
+		private:
+			template<typename T>
+			static Plane<T> makePlane(const T &a0, const T &a1, const T &a2,
+				float I1, float I2, float J1, float J2, float one_div_area)
+			{
+				//Gradient of the barycentric interpolation, the weights of v1 and v2 are the edge functions (I1,J1), (I2,J2)
+				Plane<T> plane;
+				plane.a0 = a0;
+				plane.dadx = (I1 * (a1 - a0) + I2 * (a2 - a0)) * one_div_area;
+				plane.dady = (J1 * (a1 - a0) + J2 * (a2 - a0)) * one_div_area;
+				return plane;
+			}
+		};
+
 		virtual ~TRShadingPipeline() = default;
 
+		//Copy of the pipeline with the same settings (e.g., one per rendering thread)
+		virtual TRShadingPipeline::ptr clone() const = 0;
+
 		//Vertex shader settting
 		void setModelMatrix(const glm::mat4 &model) 
 		{ 
@@ -57,28 +182,58 @@ namespace TinyRenderer
 		void setNormalTexId(const int &id) { m_normal_tex_id = id; }
 		void setGlowTexId(const int &id) { m_glow_tex_id = id; }
 		void setShininess(const float &shininess) { m_shininess = shininess; }
-		void setTangent(const glm::vec3 &tangent) { m_tangent = tangent; }
-		void setBitangent(const glm::vec3 &bitangent) { m_bitangent = bitangent; }
 		float m_shininess = 0.0f;
 		//Shaders
 		virtual void vertexShader(VertexData &vertex) = 0;
+		//Vertex shader of vertices [first, first + count) of the mesh streams, the results go to out[0, count)
+		//Note: the default one runs vertexShader vertex by vertex, pipelines override it to shade several
+		//      vertices at a time. An override has to give the same results as vertexShader.
+		virtual void vertexShaderBatch(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out);
+		//Note: the tangent and bitangent are per face, so the TBN matrix is set up after the vertex
+		//      shader, which lets shaded vertices be shared by all the faces around them.
+		void faceTangentSpace(VertexData &v0, VertexData &v1, VertexData &v2,
+			const glm::vec3 &tangent, const glm::vec3 &bitangent) const;
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) = 0;
-
-		//Rasterization
-		static void rasterize_wire(
+		//Fragment shader of the covered lanes of a span, fragColors[i] is the color of lane i
+		//Note: the default one runs fragmentShader lane by lane, pipelines override it to shade
+		//      the whole span at a time. An override has to give the same results as fragmentShader.
+		virtual void fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors);
+
+		//Deferred shading: the surface shader writes the attributes of a fragment to a G-buffer texel and the
+		//lighting shader shades a texel once per pixel. fragmentShader has to give the same result as the two.
+		//Note: pipelines without the deferred path are always shaded forward.
+		virtual bool hasDeferredPath() const { return false; }
+		virtual void surfaceShader(const VertexData &/*data*/, TRGBufferTexel &/*texel*/) {}
+		virtual void lightingShader(const TRGBufferTexel &/*texel*/, glm::vec4 &/*fragColor*/) const {}
+
+		//Compile-time specialized fragment shader for the current settings, -1 if there is none
+		//Note: queried once per draw state, the renderer then shades with that instantiation directly
+		//      instead of the virtual shaders. Only TRPhongShadingPipeline has variants so far.
+		virtual int getFragmentShaderVariant() const { return -1; }
+
+		//Rasterization restricted to the scissor rect (min_x, min_y, max_x, max_y), inclusive
+		//Note: sink(VertexData&) is invoked for every covered pixel as soon as it is generated,
+		//      so the fragments are never stored. Before that, early_test(x, y, z) is called with
+		//      only the depth interpolated, the other attributes are interpolated if it passes.
+		//      Return the number of covered pixels.
+		template<typename EarlyTest, typename FragmentSink>
+		static unsigned int rasterize_wire(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height, 
-			std::vector<VertexData> &rasterized_points);
-		static void rasterize_fill_edge_function(
+			const glm::ivec4 &scissor,
+			EarlyTest &&early_test,
+			FragmentSink &&sink);
+		//Note: the same as above except that the fragments passing the early test are gathered into spans
+		//      along the rows, span_sink(FragmentSpan&) is invoked for each span once it is full or done.
+		template<typename EarlyTest, typename SpanSink>
+		static unsigned int rasterize_fill_edge_function(
 			const VertexData &v0,
 			const VertexData &v1,
 			const VertexData &v2,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec4 &scissor,
+			EarlyTest &&early_test,
+			SpanSink &&span_sink);
 
 		//Textures and lights
 		static int upload_texture_2D(TRTexture2D::ptr tex);
@@ -89,17 +244,27 @@ namespace TinyRenderer
 		static TRSpotLight& getSpotLight(int index);
 		static void clearSpotLight() { m_spot_lights.clear(); }
 		static void setViewerPos(const glm::vec3 &viewer) { m_viewer_pos = viewer; }
+		static const std::vector<TRPointLight> &getPointLights() { return m_point_lights; }
+		//Clustered light culling of the point lights, disabled if the grid is empty
+		static TRLightGrid &getLightGrid() { return m_light_grid; }
+		//Fast math: the vector lighting of the spans uses the pow/exp approximations of TRSimd.h,
+		//otherwise they are evaluated lane by lane and the colors are exactly the ones of the scalar shaders.
+		static void setFastMath(bool enable) { m_fast_math = enable; }
+		static bool getFastMath() { return m_fast_math; }
 		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv);
+		//duv is the screen space derivatives of uv for the level of detail of the mipmaps
+		static glm::vec4 texture2D(const unsigned int &id, const glm::vec2 &uv, const glm::vec4 &duv);
 
 	protected:
 
 		//Auxiliary function
-		static void rasterize_wire_aux(
+		template<typename EarlyTest, typename FragmentSink>
+		static unsigned int rasterize_wire_aux(
 			const VertexData &begin,
 			const VertexData &end,
-			const unsigned int &screen_width,
-			const unsigned int &screene_height,
-			std::vector<VertexData> &rasterized_points);
+			const glm::ivec4 &scissor,
+			EarlyTest &&early_test,
+			FragmentSink &&sink);
 
 		glm::mat4 m_model_matrix = glm::mat4(1.0f);
 		glm::mat3 m_inv_trans_model_matrix = glm::mat3(1.0f);
@@ -109,7 +274,9 @@ namespace TinyRenderer
 		static std::vector<TRTexture2D::ptr> m_global_texture_units;
 		static std::vector<TRPointLight> m_point_lights;
 		static std::vector<TRSpotLight> m_spot_lights;
+		static TRLightGrid m_light_grid;
 		static glm::vec3 m_viewer_pos;
+		static bool m_fast_math;
 
 		//Material setting
 		glm::vec3 m_ka = glm::vec3(0.0f);
@@ -123,9 +290,6 @@ namespace TinyRenderer
 		int m_glow_tex_id = -1;
 
 		bool m_lighting_enable = true;
-
-		glm::vec3 m_tangent;
-		glm::vec3 m_bitangent;
 	};
 
 	class TRDefaultShadingPipeline : public TRShadingPipeline
@@ -136,9 +300,16 @@ namespace TinyRenderer
 
 		virtual ~TRDefaultShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRDefaultShadingPipeline>(*this); }
+
 		virtual void vertexShader(VertexData &vertex) override;
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
 
+	protected:
+		//SSE2 batch of the vertexShader above, the same results
+		//Note: not an override, so that a subclass overriding vertexShader only still gets its own vertex shader
+		//      through the per-vertex default batch. The final pipelines that keep this vertexShader use it.
+		void vertexShaderBatchDefault(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out);
 	};
 
 	class TRTextureShadingPipeline final : public TRDefaultShadingPipeline
@@ -149,7 +320,14 @@ namespace TinyRenderer
 
 		virtual ~TRTextureShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRTextureShadingPipeline>(*this); }
+
+		virtual void vertexShaderBatch(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out) override
+		{
+			vertexShaderBatchDefault(vertices, first, count, out);
+		}
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
+		virtual void fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors) override;
 	};
 
 	class TRPhongShadingPipeline final : public TRDefaultShadingPipeline
@@ -157,13 +335,490 @@ namespace TinyRenderer
 	public:
 		typedef std::shared_ptr<TRPhongShadingPipeline> ptr;
 
+		//Feature bits of the fragment shader variants
+		enum Feature : unsigned int
+		{
+			DIFFUSE_MAP = 1,
+			SPECULAR_MAP = 2,
+			GLOW_MAP = 4,
+			SPECULAR = 8,         //Off if the specular color is 0, i.e., the highlights are skipped
+			LIGHTING = 16,
+			LIGHT_CULLING = 32,
+			NUM_VARIANTS = 64
+		};
+
 		virtual ~TRPhongShadingPipeline() = default;
 
+		virtual TRShadingPipeline::ptr clone() const override { return std::make_shared<TRPhongShadingPipeline>(*this); }
+
+		virtual void vertexShaderBatch(const TRVertexAttrib &vertices, size_t first, size_t count, VertexData *out) override
+		{
+			vertexShaderBatchDefault(vertices, first, count, out);
+		}
+
 		virtual void fragmentShader(const VertexData &data, glm::vec4 &fragColor) override;
 
+		virtual bool hasDeferredPath() const override { return true; }
+		virtual void surfaceShader(const VertexData &data, TRGBufferTexel &texel) override;
+		virtual void lightingShader(const TRGBufferTexel &texel, glm::vec4 &fragColor) const override;
+
+		//The shaders above with the features fixed at compile time, same results for the same settings
+		virtual int getFragmentShaderVariant() const override;
+		template<unsigned int Features>
+		void fragmentShaderVariant(const VertexData &data, glm::vec4 &fragColor) const;
+		template<unsigned int Features>
+		void surfaceShaderVariant(const VertexData &data, TRGBufferTexel &texel) const;
+
+		//Span shaders: the surface attributes of all the lanes first, then the lights one by one over the lanes
+		virtual void fragmentShaderSpan(const FragmentSpan &span, glm::vec4 *fragColors) override;
+		template<unsigned int Features>
+		void fragmentShaderSpanVariant(const FragmentSpan &span, glm::vec4 *fragColors) const
+		{
+			SurfaceSpan surface;
+			fetchSurfaceSpan(span, Features, surface);
+			shadeSurfaceSpan(surface, span.mask, Features, fragColors);
+		}
+
+		//Entry points of a variant, looked up once per triangle by the renderer
+		//Note: only the variants getFragmentShaderVariant can return are instantiated, the others are null.
+		struct VariantShaders
+		{
+			void (TRPhongShadingPipeline::*fragmentShader)(const VertexData &data, glm::vec4 &fragColor) const;
+			void (TRPhongShadingPipeline::*surfaceShader)(const VertexData &data, TRGBufferTexel &texel) const;
+			void (TRPhongShadingPipeline::*fragmentShaderSpan)(const FragmentSpan &span, glm::vec4 *fragColors) const;
+		};
+		static const VariantShaders &getVariantShaders(int variant);
+		static constexpr bool isReachableVariant(unsigned int features)
+		{
+			//Without lighting only the glow map is used, the specular map always comes with the specular term
+			return (features & LIGHTING) ? ((features & SPECULAR) || !(features & SPECULAR_MAP)) : (features & ~GLOW_MAP) == 0;
+		}
+
 	private:
+		//Surface attributes of the lanes of a span in SoA layout
+		struct SurfaceSpan
+		{
+			static constexpr int N = FragmentSpan::max_width;
+			float px[N], py[N], pz[N];    //World space position
+			float nx[N], ny[N], nz[N];    //World space normal
+			float ar[N], ag[N], ab[N];    //Albedo
+			float sr[N], sg[N], sb[N];    //Specular color
+			float er[N], eg[N], eb[N];    //Emission
+		};
+
 		void fetchFragmentColor(glm::vec3 &amb, glm::vec3 &diff, glm::vec3 &spec, const glm::vec2 &uv) const;
+		//Blinn-Phong lighting of a lit texel plus the tone mapping
+		template<bool LightCulling, bool Specular>
+		void calcLighting(const TRGBufferTexel &texel, glm::vec4 &fragColor) const;
+
+		//Note: the features are the variant bits, the branches fold away when they are constant.
+		void fetchSurfaceSpan(const FragmentSpan &span, unsigned int features, SurfaceSpan &surface) const;
+		void shadeSurfaceSpan(const SurfaceSpan &surface, unsigned int mask, unsigned int features, glm::vec4 *fragColors) const;
+		template<bool LightCulling, bool Specular>
+		void calcLightingSpan(const SurfaceSpan &surface, unsigned int mask, glm::vec4 *fragColors) const;
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+		//Same as calcLightingSpan without the light culling, TRFloatN::width lanes at a time
+		template<bool Specular>
+		void calcLightingSpanSimd(const SurfaceSpan &surface, unsigned int mask, glm::vec4 *fragColors) const;
+#endif
 	};
+
+	inline void TRPhongShadingPipeline::fetchSurfaceSpan(const FragmentSpan &span, unsigned int features, SurfaceSpan &surface) const
+	{
+		for (unsigned int m = span.mask; m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			const glm::vec2 uv(span.u[i], span.v[i]);
+			const glm::vec4 duv(span.dudx[i], span.dvdx[i], span.dudy[i], span.dvdy[i]);
+			const glm::vec3 albedo = (features & DIFFUSE_MAP) ? glm::vec3(texture2D(m_diffuse_tex_id, uv, duv)) : m_kd;
+			const glm::vec3 specular = (features & SPECULAR_MAP) ? glm::vec3(texture2D(m_specular_tex_id, uv, duv)) : m_ks;
+			const glm::vec3 emission = (features & GLOW_MAP) ? glm::vec3(texture2D(m_glow_tex_id, uv, duv)) : m_ke;
+			surface.px[i] = span.px[i]; surface.py[i] = span.py[i]; surface.pz[i] = span.pz[i];
+			surface.nx[i] = span.nx[i]; surface.ny[i] = span.ny[i]; surface.nz[i] = span.nz[i];
+			surface.ar[i] = albedo.x; surface.ag[i] = albedo.y; surface.ab[i] = albedo.z;
+			surface.sr[i] = specular.x; surface.sg[i] = specular.y; surface.sb[i] = specular.z;
+			surface.er[i] = emission.x; surface.eg[i] = emission.y; surface.eb[i] = emission.z;
+		}
+
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+		//The uncovered lanes copy a covered one so that the vector lighting computes finite values on them
+		if (span.mask == 0)
+			return;
+		const int j = TRBitScanForward(span.mask);
+		for (unsigned int m = ~span.mask & ((1u << FragmentSpan::max_width) - 1); m != 0; m &= m - 1)
+		{
+			const int i = TRBitScanForward(m);
+			surface.px[i] = surface.px[j]; surface.py[i] = surface.py[j]; surface.pz[i] = surface.pz[j];
+			surface.nx[i] = surface.nx[j]; surface.ny[i] = surface.ny[j]; surface.nz[i] = surface.nz[j];
+			surface.ar[i] = surface.ar[j]; surface.ag[i] = surface.ag[j]; surface.ab[i] = surface.ab[j];
+			surface.sr[i] = surface.sr[j]; surface.sg[i] = surface.sg[j]; surface.sb[i] = surface.sb[j];
+			surface.er[i] = surface.er[j]; surface.eg[i] = surface.eg[j]; surface.eb[i] = surface.eb[j];
+		}
+#endif
+	}
+
+	template<unsigned int Features>
+	void TRPhongShadingPipeline::fragmentShaderVariant(const VertexData &data, glm::vec4 &fragColor) const
+	{
+		TRGBufferTexel texel;
+		surfaceShaderVariant<Features>(data, texel);
+		if (Features & LIGHTING)
+			calcLighting<(Features & LIGHT_CULLING) != 0, (Features & SPECULAR) != 0>(texel, fragColor);
+		else
+			fragColor = glm::vec4(texel.emission, 1.0f);
+	}
+
+	template<unsigned int Features>
+	void TRPhongShadingPipeline::surfaceShaderVariant(const VertexData &data, TRGBufferTexel &texel) const
+	{
+		texel.albedo = (Features & DIFFUSE_MAP) ? glm::vec3(texture2D(m_diffuse_tex_id, data.tex, data.duv)) : m_kd;
+		texel.specular = (Features & SPECULAR_MAP) ? glm::vec3(texture2D(m_specular_tex_id, data.tex, data.duv)) : m_ks;
+		texel.emission = (Features & GLOW_MAP) ? glm::vec3(texture2D(m_glow_tex_id, data.tex, data.duv)) : m_ke;
+		texel.position = glm::vec3(data.pos);
+		texel.normal = data.nor;
+		texel.tint = glm::vec3(1.0f);
+		texel.shininess = m_shininess;
+		texel.lit = (Features & LIGHTING) != 0;
+	}
+
+	//----------------------------------------------Rasterization----------------------------------------------
+
+	template<typename EarlyTest, typename FragmentSink>
+	unsigned int TRShadingPipeline::rasterize_wire(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec4 &scissor,
+		EarlyTest &&early_test,
+		FragmentSink &&sink)
+	{
+		//Draw each line step by step
+		unsigned int num_covered = 0;
+		num_covered += rasterize_wire_aux(v0, v1, scissor, early_test, sink);
+		num_covered += rasterize_wire_aux(v1, v2, scissor, early_test, sink);
+		num_covered += rasterize_wire_aux(v0, v2, scissor, early_test, sink);
+		return num_covered;
+	}
+
+	template<typename EarlyTest, typename SpanSink>
+	unsigned int TRShadingPipeline::rasterize_fill_edge_function(
+		const VertexData &v0,
+		const VertexData &v1,
+		const VertexData &v2,
+		const glm::ivec4 &scissor,
+		EarlyTest &&early_test,
+		SpanSink &&span_sink)
+	{
+		VertexData v[] = { v0, v1, v2 };
+		//Edge-equations rasterization algorithm
+		//Note: the bounding box is clamped to the scissor rect, edge functions are exact integers,
+		//      so every pixel gets the same result no matter where the scan starts.
+		glm::ivec2 bounding_min;
+		glm::ivec2 bounding_max;
+		bounding_min.x = std::max(std::min(v0.spos.x, std::min(v1.spos.x, v2.spos.x)), scissor.x);
+		bounding_min.y = std::max(std::min(v0.spos.y, std::min(v1.spos.y, v2.spos.y)), scissor.y);
+		bounding_max.x = std::min(std::max(v0.spos.x, std::max(v1.spos.x, v2.spos.x)), scissor.z);
+		bounding_max.y = std::min(std::max(v0.spos.y, std::max(v1.spos.y, v2.spos.y)), scissor.w);
+
+		//Adjust the order
+		{
+			auto e1 = v1.spos - v0.spos;
+			auto e2 = v2.spos - v0.spos;
+			int orient = e1.x * e2.y - e1.y * e2.x;
+			if (orient > 0)
+			{
+				std::swap(v[1], v[2]);
+			}
+		}
+
+		//Accelerated Half-Space Triangle Rasterization
+		//Refs:Mileff P, Nehz K, Dudra J. Accelerated half-space triangle rasterization[J].
+		//     Acta Polytechnica Hungarica, 2015, 12(7): 217-236. http://acta.uni-obuda.hu/Mileff_Nehez_Dudra_63.pdf
+
+		const glm::ivec2 &A = v[0].spos;
+		const glm::ivec2 &B = v[1].spos;
+		const glm::ivec2 &C = v[2].spos;
+
+		const int I01 = A.y - B.y, I02 = B.y - C.y, I03 = C.y - A.y;
+		const int J01 = B.x - A.x, J02 = C.x - B.x, J03 = A.x - C.x;
+		const int K01 = A.x * B.y - A.y * B.x;
+		const int K02 = B.x * C.y - B.y * C.x;
+		const int K03 = C.x * A.y - C.y * A.x;
+
+		int F01 = I01 * bounding_min.x + J01 * bounding_min.y + K01;
+		int F02 = I02 * bounding_min.x + J02 * bounding_min.y + K02;
+		int F03 = I03 * bounding_min.x + J03 * bounding_min.y + K03;
+
+		//Degenerated to a line or a point
+		if (F01 + F02 + F03 == 0)
+			return 0;
+
+		//Triangle setup: plane equations instead of per-pixel barycentric interpolation
+		TriangleSetup triangle;
+		triangle.setup(v[0], v[1], v[2]);
+
+		//Top left fill rule
+		int E1_t = (((B.y > A.y) || (A.y == B.y && A.x > B.x)) ? 0 : 0);
+		int E2_t = (((C.y > B.y) || (B.y == C.y && B.x > C.x)) ? 0 : 0);
+		int E3_t = (((A.y > C.y) || (C.y == A.y && C.x > A.x)) ? 0 : 0);
+
+		//A covered pixel
+		//Note: a pixel is covered once per triangle, so delaying the shading to the end of the span
+		//      doesn't change the early test results.
+		unsigned int num_covered = 0;
+		FragmentSpan span;
+		span.mask = 0;
+		span.TBN = triangle.TBN;
+		span.tex_gradient = glm::vec4(triangle.tex.dadx, triangle.tex.dady);
+		span.w_gradient = glm::vec2(triangle.pos.dadx.w, triangle.pos.dady.w);
+		auto covered_pixel = [&](int x, int y)
+		{
+			++num_covered;
+			//Early depth test: only z is interpolated before it
+			float z = triangle.interpolateDepth(x, y);
+			if (early_test(x, y, z))
+			{
+				//Start a new span if the pixel is not in the current one
+				if (span.mask != 0 && (y != span.y || x < span.x || x >= span.x + FragmentSpan::max_width))
+				{
+					span_sink(span);
+					span.mask = 0;
+				}
+				if (span.mask == 0)
+				{
+					span.x = x;
+					span.y = y;
+				}
+				const int lane = x - span.x;
+				triangle.interpolate(x, y, span, lane);
+				span.mask |= 1u << lane;
+			}
+		};
+
+		//SIMD kernel: test a row of 8 (AVX2) or 4 (SSE2) pixels at once and get a coverage mask
+		//Note: edge functions are integers, so the covered pixels are exactly the same as the scalar loop
+#if defined(TR_SIMD_AVX2)
+		constexpr int simd_width = 8;
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i step1 = _mm256_mullo_epi32(lane, _mm256_set1_epi32(I01));
+		const __m256i step2 = _mm256_mullo_epi32(lane, _mm256_set1_epi32(I02));
+		const __m256i step3 = _mm256_mullo_epi32(lane, _mm256_set1_epi32(I03));
+#elif defined(TR_SIMD_SSE2)
+		constexpr int simd_width = 4;
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i step1 = _mm_setr_epi32(0, I01, 2 * I01, 3 * I01);
+		const __m128i step2 = _mm_setr_epi32(0, I02, 2 * I02, 3 * I02);
+		const __m128i step3 = _mm_setr_epi32(0, I03, 2 * I03, 3 * I03);
+#endif
+
+		//Scan the rows of [x0,x1]*[y0,y1] with the per-pixel edge tests
+		auto scan_rows = [&](int x0, int x1, int y0, int y1)
+		{
+			int Cy1 = I01 * x0 + J01 * y0 + K01;
+			int Cy2 = I02 * x0 + J02 * y0 + K02;
+			int Cy3 = I03 * x0 + J03 * y0 + K03;
+			for (int y = y0; y <= y1; ++y)
+			{
+				int Cx1 = Cy1, Cx2 = Cy2, Cx3 = Cy3;
+				int x = x0;
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+				for (; x + simd_width - 1 <= x1; x += simd_width)
+				{
+					//Counter-clockwise winding order: covered if no edge function is positive
+#if defined(TR_SIMD_AVX2)
+					__m256i E1 = _mm256_add_epi32(_mm256_set1_epi32(Cx1 + E1_t), step1);
+					__m256i E2 = _mm256_add_epi32(_mm256_set1_epi32(Cx2 + E2_t), step2);
+					__m256i E3 = _mm256_add_epi32(_mm256_set1_epi32(Cx3 + E3_t), step3);
+					__m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(E1, zero),
+						_mm256_or_si256(_mm256_cmpgt_epi32(E2, zero), _mm256_cmpgt_epi32(E3, zero)));
+					unsigned int mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFFu;
+#else
+					__m128i E1 = _mm_add_epi32(_mm_set1_epi32(Cx1 + E1_t), step1);
+					__m128i E2 = _mm_add_epi32(_mm_set1_epi32(Cx2 + E2_t), step2);
+					__m128i E3 = _mm_add_epi32(_mm_set1_epi32(Cx3 + E3_t), step3);
+					__m128i outside = _mm_or_si128(_mm_cmpgt_epi32(E1, zero),
+						_mm_or_si128(_mm_cmpgt_epi32(E2, zero), _mm_cmpgt_epi32(E3, zero)));
+					unsigned int mask = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xFu;
+#endif
+					while (mask != 0)
+					{
+						int k = TRBitScanForward(mask);
+						mask &= mask - 1;
+						covered_pixel(x + k, y);
+					}
+					Cx1 += simd_width * I01; Cx2 += simd_width * I02; Cx3 += simd_width * I03;
+				}
+#endif
+				//Scalar path for the rest of the row (and for the targets without SIMD)
+				for (; x <= x1; ++x)
+				{
+					int E1 = Cx1 + E1_t, E2 = Cx2 + E2_t, E3 = Cx3 + E3_t;
+					//Counter-clockwise winding order
+					if (E1 <= 0 && E2 <= 0 && E3 <= 0)
+					{
+						covered_pixel(x, y);
+					}
+					Cx1 += I01; Cx2 += I02; Cx3 += I03;
+				}
+				Cy1 += J01; Cy2 += J02; Cy3 += J03;
+			}
+		};
+
+		//Small triangles: the block classification does not pay off
+		constexpr int block_size = 8;
+		if (bounding_max.x - bounding_min.x < block_size && bounding_max.y - bounding_min.y < block_size)
+		{
+			scan_rows(bounding_min.x, bounding_max.x, bounding_min.y, bounding_max.y);
+			if (span.mask != 0)
+				span_sink(span);
+			return num_covered;
+		}
+
+		//Hierarchical rasterization: classify the 8x8 blocks by the edge functions at their corners
+		//Note: an edge function is linear, so it is positive (or not) over a whole block
+		//      if it is at the four corners of that block.
+		auto classify = [](int I, int J, int K, int x0, int x1, int y0, int y1, int &num_outside) -> bool
+		{
+			int e00 = I * x0 + J * y0 + K, e10 = I * x1 + J * y0 + K;
+			int e01 = I * x0 + J * y1 + K, e11 = I * x1 + J * y1 + K;
+			num_outside = (e00 > 0) + (e10 > 0) + (e01 > 0) + (e11 > 0);
+			return num_outside == 4;
+		};
+		for (int by = bounding_min.y & ~(block_size - 1); by <= bounding_max.y; by += block_size)
+		{
+			const int y0 = std::max(by, bounding_min.y);
+			const int y1 = std::min(by + block_size - 1, bounding_max.y);
+			for (int bx = bounding_min.x & ~(block_size - 1); bx <= bounding_max.x; bx += block_size)
+			{
+				const int x0 = std::max(bx, bounding_min.x);
+				const int x1 = std::min(bx + block_size - 1, bounding_max.x);
+
+				//Trivial reject: the whole block is outside of one edge
+				int out1, out2, out3;
+				if (classify(I01, J01, K01 + E1_t, x0, x1, y0, y1, out1) ||
+					classify(I02, J02, K02 + E2_t, x0, x1, y0, y1, out2) ||
+					classify(I03, J03, K03 + E3_t, x0, x1, y0, y1, out3))
+					continue;
+
+				//Partially covered: per-pixel edge tests
+				if (out1 + out2 + out3 != 0)
+				{
+					scan_rows(x0, x1, y0, y1);
+					continue;
+				}
+
+				//Trivial accept: every pixel of the block is covered
+				for (int y = y0; y <= y1; ++y)
+				{
+					for (int x = x0; x <= x1; ++x)
+						covered_pixel(x, y);
+				}
+			}
+		}
+
+		if (span.mask != 0)
+			span_sink(span);
+		return num_covered;
+	}
+
+	template<typename EarlyTest, typename FragmentSink>
+	unsigned int TRShadingPipeline::rasterize_wire_aux(
+		const VertexData &from,
+		const VertexData &to,
+		const glm::ivec4 &scissor,
+		EarlyTest &&early_test,
+		FragmentSink &&sink)
+	{
+		//Bresenham line rasterization
+
+		int dx = to.spos.x - from.spos.x;
+		int dy = to.spos.y - from.spos.y;
+		int stepX = 1, stepY = 1;
+
+		// judge the sign
+		if (dx < 0)
+		{
+			stepX = -1;
+			dx = -dx;
+		}
+		if (dy < 0)
+		{
+			stepY = -1;
+			dy = -dy;
+		}
+
+		int d2x = 2 * dx, d2y = 2 * dy;
+		int d2y_minus_d2x = d2y - d2x;
+		int sx = from.spos.x;
+		int sy = from.spos.y;
+		unsigned int num_covered = 0;
+
+		// slope < 1.
+		if (dy <= dx)
+		{
+			int flag = d2y - dx;
+			for (int i = 0; i <= dx; ++i)
+			{
+				if (sx >= scissor.x && sx <= scissor.z && sy >= scissor.y && sy <= scissor.w)
+				{
+					++num_covered;
+					float frac = static_cast<float>(i) / dx;
+					//Early depth test: only z is interpolated before it
+					float z = (1.0f - frac) * from.cpos.z + frac * to.cpos.z;
+					if (early_test(sx, sy, z))
+					{
+						auto mid = VertexData::lerp(from, to, frac);
+						mid.spos = glm::ivec2(sx, sy);
+						sink(mid);
+					}
+				}
+				sx += stepX;
+				if (flag <= 0)
+				{
+					flag += d2y;
+				}
+				else
+				{
+					sy += stepY;
+					flag += d2y_minus_d2x;
+				}
+			}
+		}
+		// slope > 1.
+		else
+		{
+			int flag = d2x - dy;
+			for (int i = 0; i <= dy; ++i)
+			{
+				if (sx >= scissor.x && sx <= scissor.z && sy >= scissor.y && sy <= scissor.w)
+				{
+					++num_covered;
+					float frac = static_cast<float>(i) / dy;
+					//Early depth test: only z is interpolated before it
+					float z = (1.0f - frac) * from.cpos.z + frac * to.cpos.z;
+					if (early_test(sx, sy, z))
+					{
+						auto mid = VertexData::lerp(from, to, frac);
+						mid.spos = glm::ivec2(sx, sy);
+						sink(mid);
+					}
+				}
+				sy += stepY;
+				if (flag <= 0)
+				{
+					flag += d2x;
+				}
+				else
+				{
+					sx += stepX;
+					flag -= d2y_minus_d2x;
+				}
+			}
+		}
+
+		return num_covered;
+	}
 }
 
 #endif
\ No newline at end of file
@@ -1,6 +1,10 @@
 #ifndef TRSHADING_STATE_H
 #define TRSHADING_STATE_H
 
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
 #include "glm/glm.hpp"
 
 namespace TinyRenderer
@@ -13,10 +17,16 @@ namespace TinyRenderer
 	};
 
 	//Texture filtering mode
+	//Note: X_MIPMAP_Y filters the texels of a mip level with X and the two nearest levels with Y,
+	//      the level of detail comes from the screen space derivatives of the texture coordinate.
 	enum TRTextureFilterMode
 	{
 		TR_NEAREST,
-		TR_LINEAR
+		TR_LINEAR,
+		TR_NEAREST_MIPMAP_NEAREST,
+		TR_LINEAR_MIPMAP_NEAREST,
+		TR_NEAREST_MIPMAP_LINEAR,
+		TR_LINEAR_MIPMAP_LINEAR
 	};
 
 	//Polygon mode
@@ -52,6 +62,14 @@ namespace TinyRenderer
 		TR_LIGHTING_ENABLE
 	};
 
+	//Draw order of the meshes
+	enum TRDrawOrderMode
+	{
+		TR_DRAW_ORDER_SUBMISSION,           //In the order the meshes were added
+		TR_DRAW_ORDER_FRONT_TO_BACK,        //Mesh instances and submeshes sorted by view space depth
+		TR_DRAW_ORDER_FRONT_TO_BACK_CLUSTER //Also the face clusters inside of a submesh
+	};
+
 	//Point lights
 	class TRPointLight
 	{
@@ -62,6 +80,21 @@ namespace TinyRenderer
 
 		TRPointLight(glm::vec3 pos, glm::vec3 atten, glm::vec3 color)
 			: lightPos(pos), attenuation(atten), lightColor(color) {}
+
+		//Distance where the attenuated intensity 1 / (c + l * d + q * d^2) * max(color) drops to the threshold
+		//Note: infinite if the light doesn't fall off with the distance.
+		float calcEffectiveRadius(float threshold) const
+		{
+			const float c = attenuation.x, l = attenuation.y, q = attenuation.z;
+			const float k = c - std::max(lightColor.x, std::max(lightColor.y, lightColor.z)) / threshold;
+			if (k >= 0.0f)
+				return 0.0f;
+			if (q > 0.0f)
+				return (-l + std::sqrt(l * l - 4.0f * q * k)) / (2.0f * q);
+			if (l > 0.0f)
+				return -k / l;
+			return std::numeric_limits<float>::infinity();
+		}
 	};
 	class TRSpotLight
 	{
@@ -0,0 +1,219 @@
+#ifndef TRSIMD_H
+#define TRSIMD_H
+
+//SIMD instruction sets available at compile time
+//Note: SSE2 is always there on x86-64, AVX2 has to be enabled by the compiler (e.g., -mavx2 or /arch:AVX2)
+#if defined(__AVX2__)
+#define TR_SIMD_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TR_SIMD_SSE2
+#endif
+
+#if defined(TR_SIMD_AVX2)
+#include <immintrin.h>
+#elif defined(TR_SIMD_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include <new>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+namespace TinyRenderer
+{
+	//Index of the lowest set bit of a coverage mask
+	//Note: mask must not be zero
+	inline int TRBitScanForward(unsigned int mask)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return static_cast<int>(index);
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	//Allocator of arrays aligned for SIMD loads (32 bytes, i.e., one AVX register)
+	template<typename T, size_t Alignment = 32>
+	class TRAlignedAllocator
+	{
+	public:
+		typedef T value_type;
+		template<typename U> struct rebind { typedef TRAlignedAllocator<U, Alignment> other; };
+
+		TRAlignedAllocator() = default;
+		template<typename U> TRAlignedAllocator(const TRAlignedAllocator<U, Alignment> &) {}
+
+		T* allocate(size_t n)
+		{
+			//Over-allocate and keep the original pointer right before the aligned block
+			void *raw = std::malloc(n * sizeof(T) + Alignment + sizeof(void*));
+			if (raw == nullptr)
+				throw std::bad_alloc();
+			std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + Alignment - 1)
+				& ~static_cast<std::uintptr_t>(Alignment - 1);
+			reinterpret_cast<void**>(aligned)[-1] = raw;
+			return reinterpret_cast<T*>(aligned);
+		}
+		void deallocate(T *p, size_t)
+		{
+			if (p != nullptr)
+				std::free(reinterpret_cast<void**>(p)[-1]);
+		}
+
+		template<typename U> bool operator==(const TRAlignedAllocator<U, Alignment> &) const { return true; }
+		template<typename U> bool operator!=(const TRAlignedAllocator<U, Alignment> &) const { return false; }
+	};
+
+	template<typename T>
+	using TRAlignedVector = std::vector<T, TRAlignedAllocator<T>>;
+
+#if defined(TR_SIMD_AVX2) || defined(TR_SIMD_SSE2)
+	//Packed floats of the widest registers available, one lane per fragment for the SoA shading
+	//Note: the operators are the IEEE ones, i.e., the same results as the scalar code lane by lane.
+	struct TRFloatN
+	{
+#if defined(TR_SIMD_AVX2)
+		static constexpr int width = 8;
+		__m256 v;
+		TRFloatN() = default;
+		TRFloatN(__m256 x) : v(x) {}
+		explicit TRFloatN(float x) : v(_mm256_set1_ps(x)) {}
+		static TRFloatN load(const float *p) { return _mm256_loadu_ps(p); }
+		void store(float *p) const { _mm256_storeu_ps(p, v); }
+#else
+		static constexpr int width = 4;
+		__m128 v;
+		TRFloatN() = default;
+		TRFloatN(__m128 x) : v(x) {}
+		explicit TRFloatN(float x) : v(_mm_set1_ps(x)) {}
+		static TRFloatN load(const float *p) { return _mm_loadu_ps(p); }
+		void store(float *p) const { _mm_storeu_ps(p, v); }
+#endif
+	};
+
+#if defined(TR_SIMD_AVX2)
+	inline TRFloatN operator+(TRFloatN a, TRFloatN b) { return _mm256_add_ps(a.v, b.v); }
+	inline TRFloatN operator-(TRFloatN a, TRFloatN b) { return _mm256_sub_ps(a.v, b.v); }
+	inline TRFloatN operator*(TRFloatN a, TRFloatN b) { return _mm256_mul_ps(a.v, b.v); }
+	inline TRFloatN operator/(TRFloatN a, TRFloatN b) { return _mm256_div_ps(a.v, b.v); }
+	inline TRFloatN operator-(TRFloatN a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+	inline TRFloatN TRSqrt(TRFloatN a) { return _mm256_sqrt_ps(a.v); }
+	//Note: b if a or b is NaN, i.e., TRMax(a, b) is std::max(b, a)
+	inline TRFloatN TRMax(TRFloatN a, TRFloatN b) { return _mm256_max_ps(a.v, b.v); }
+	inline TRFloatN TRMin(TRFloatN a, TRFloatN b) { return _mm256_min_ps(a.v, b.v); }
+	//a * 2^n, n has to be an integer in [-126, 127]
+	inline TRFloatN TRLdexp(TRFloatN a, TRFloatN n)
+	{
+		__m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n.v), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(a.v, _mm256_castsi256_ps(e));
+	}
+	//x = m * 2^e with m in [1, 2), x has to be a positive normal number
+	inline void TRFrexp(TRFloatN x, TRFloatN &m, TRFloatN &e)
+	{
+		__m256i bits = _mm256_castps_si256(x.v);
+		e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+		m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007FFFFF)), _mm256_set1_epi32(0x3F800000)));
+	}
+	inline TRFloatN TRRound(TRFloatN a) { return _mm256_round_ps(a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	//Lane masks: all bits set where the comparison holds
+	inline TRFloatN TRGreater(TRFloatN a, TRFloatN b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	inline TRFloatN TRSelect(TRFloatN mask, TRFloatN a, TRFloatN b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+	inline TRFloatN TRAnd(TRFloatN mask, TRFloatN a) { return _mm256_and_ps(mask.v, a.v); }
+#else
+	inline TRFloatN operator+(TRFloatN a, TRFloatN b) { return _mm_add_ps(a.v, b.v); }
+	inline TRFloatN operator-(TRFloatN a, TRFloatN b) { return _mm_sub_ps(a.v, b.v); }
+	inline TRFloatN operator*(TRFloatN a, TRFloatN b) { return _mm_mul_ps(a.v, b.v); }
+	inline TRFloatN operator/(TRFloatN a, TRFloatN b) { return _mm_div_ps(a.v, b.v); }
+	inline TRFloatN operator-(TRFloatN a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+	inline TRFloatN TRSqrt(TRFloatN a) { return _mm_sqrt_ps(a.v); }
+	//Note: b if a or b is NaN, i.e., TRMax(a, b) is std::max(b, a)
+	inline TRFloatN TRMax(TRFloatN a, TRFloatN b) { return _mm_max_ps(a.v, b.v); }
+	inline TRFloatN TRMin(TRFloatN a, TRFloatN b) { return _mm_min_ps(a.v, b.v); }
+	//a * 2^n, n has to be an integer in [-126, 127]
+	inline TRFloatN TRLdexp(TRFloatN a, TRFloatN n)
+	{
+		__m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n.v), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(a.v, _mm_castsi128_ps(e));
+	}
+	//x = m * 2^e with m in [1, 2), x has to be a positive normal number
+	inline void TRFrexp(TRFloatN x, TRFloatN &m, TRFloatN &e)
+	{
+		__m128i bits = _mm_castps_si128(x.v);
+		e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+		m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+	}
+	//Note: no SSE4.1 round, the conversion rounds to the nearest (|a| < 2^31)
+	inline TRFloatN TRRound(TRFloatN a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a.v)); }
+	//Lane masks: all bits set where the comparison holds
+	inline TRFloatN TRGreater(TRFloatN a, TRFloatN b) { return _mm_cmpgt_ps(a.v, b.v); }
+	inline TRFloatN TRSelect(TRFloatN mask, TRFloatN a, TRFloatN b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+	inline TRFloatN TRAnd(TRFloatN mask, TRFloatN a) { return _mm_and_ps(mask.v, a.v); }
+#endif
+
+	//Vector approximations of the transcendental functions for the SoA shading
+	//Refs: Moshier S L. Cephes mathematical library, exp2f.c and logf.c. http://www.netlib.org/cephes/
+	//Note: the error bounds are measured against std::exp2/std::log2/std::pow in double over the ranges given.
+
+	//2^x, relative error < 1.0e-7 for x in [-126, 127] (x is clamped to it)
+	inline TRFloatN TRExp2(TRFloatN x)
+	{
+		x = TRMin(TRMax(x, TRFloatN(-126.0f)), TRFloatN(127.0f));
+		//2^x = 2^n * 2^f with f in [-0.5, 0.5], 2^f by a minimax polynomial
+		const TRFloatN n = TRRound(x);
+		const TRFloatN f = x - n;
+		TRFloatN p = TRFloatN(1.535336188319500e-4f);
+		p = p * f + TRFloatN(1.339887440266574e-3f);
+		p = p * f + TRFloatN(9.618437357674640e-3f);
+		p = p * f + TRFloatN(5.550332471162809e-2f);
+		p = p * f + TRFloatN(2.402264791363012e-1f);
+		p = p * f + TRFloatN(6.931472028550421e-1f);
+		p = p * f + TRFloatN(1.0f);
+		return TRLdexp(p, n);
+	}
+
+	//log2(x) for a positive normal x, absolute error < 1.5e-7 if |log2(x)| < 1, relative error < 1.1e-7 otherwise
+	inline TRFloatN TRLog2(TRFloatN x)
+	{
+		//x = m * 2^e with m in [sqrt(0.5), sqrt(2)), log(m) = 2 * atanh(s) with s = (m - 1) / (m + 1)
+		const TRFloatN one(1.0f);
+		TRFloatN m, e;
+		TRFrexp(x, m, e);
+		const TRFloatN big = TRGreater(m, TRFloatN(1.41421356f));
+		m = TRSelect(big, m * TRFloatN(0.5f), m);
+		e = e + TRAnd(big, one);
+		const TRFloatN s = (m - one) / (m + one);
+		const TRFloatN s2 = s * s;
+		//(2 / ln(2)) * (s + s^3 / 3 + s^5 / 5 + s^7 / 7 + s^9 / 9), |s| < 0.172
+		TRFloatN p = TRFloatN(1.0f / 9.0f);
+		p = p * s2 + TRFloatN(1.0f / 7.0f);
+		p = p * s2 + TRFloatN(1.0f / 5.0f);
+		p = p * s2 + TRFloatN(1.0f / 3.0f);
+		p = p * s2 + one;
+		return e + p * s * TRFloatN(2.88539008f);
+	}
+
+	//x^y for x >= 0, relative error < 2.0e-7 + 2.1e-7 * |y * log2(x)|
+	//Note: 0^y is 1 for y = 0 and 2^-126 (instead of 0) for y >= 1.
+	inline TRFloatN TRPow(TRFloatN x, TRFloatN y)
+	{
+		return TRExp2(y * TRLog2(TRMax(x, TRFloatN(1.17549435e-38f))));
+	}
+
+	//e^x, relative error < 2.0e-7 + 7.0e-8 * |x| for x in [-87, 88]
+	inline TRFloatN TRExp(TRFloatN x)
+	{
+		return TRExp2(x * TRFloatN(1.44269504f));
+	}
+#endif
+}
+
+#endif
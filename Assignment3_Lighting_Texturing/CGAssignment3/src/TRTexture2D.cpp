@@ -4,13 +4,15 @@
 #include "stb_image.h"
 
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 namespace TinyRenderer
 {
 	//----------------------------------------------TRTexture2D----------------------------------------------
 
 	TRTexture2D::TRTexture2D() :
-		m_width(0), m_height(0), m_channel(0), m_pixels(nullptr),
+		m_width(0), m_height(0), m_channel(0),
 		m_warp_mode(TRTextureWarpMode::TR_REPEAT),
 		m_filtering_mode(TRTextureFilterMode::TR_NEAREST) {}
 
@@ -32,58 +34,83 @@ namespace TinyRenderer
 
 		//Load image from given file using stb_image.h
 		//Refs: https://github.com/nothings/stb
+		unsigned char *pixels = nullptr;
 		{
 			stbi_set_flip_vertically_on_load(true);
-			m_pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 0);
+			pixels = stbi_load(filepath.c_str(), &m_width, &m_height, &m_channel, 0);
 		}
 
-		if (m_pixels == nullptr)
+		if (pixels == nullptr)
 		{
 			std::cerr << "Failed to load image from " << filepath << std::endl;
 			exit(1);
 		}
 
+		m_pixels.assign(pixels, pixels + static_cast<size_t>(m_width) * m_height * m_channel);
+		stbi_image_free(pixels);
+
+		buildMipmaps();
+
 		return true;
 	}
 
-	void TRTexture2D::readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const
+	void TRTexture2D::buildMipmaps()
 	{
-		//Handling out of range situation
+		//Box filtered mip chain down to 1x1, each texel is the average of 2x2 texels of the previous level
+		//Note: an odd size is rounded down, i.e., the last row or column of the previous level is dropped.
+		m_levels.assign(1, MipLevel{ m_width, m_height, 0 });
+		m_pixels.reserve(m_pixels.size() + m_pixels.size() / 3 + 4 * m_channel * (m_width + m_height));
+		while (m_levels.back().width > 1 || m_levels.back().height > 1)
 		{
-			if (u < 0 || u >= m_width)
-			{
-				switch (m_warp_mode)
-				{
-				case TRTextureWarpMode::TR_REPEAT:
-					u = u > 0 ? (u % m_width) : (m_width - 1 + u % m_width);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
-				default:
-					u = (u < 0) ? 0 : m_width - 1;
-					break;
-				}
-			}
+			const MipLevel src = m_levels.back();
+			const MipLevel dst = { std::max(src.width / 2, 1), std::max(src.height / 2, 1), m_pixels.size() };
+			m_pixels.resize(dst.offset + static_cast<size_t>(dst.width) * dst.height * m_channel);
 
-			if (v < 0 || v >= m_height)
+			const unsigned char *src_pixels = &m_pixels[src.offset];
+			unsigned char *dst_pixels = &m_pixels[dst.offset];
+			for (int y = 0; y < dst.height; ++y)
 			{
-				switch (m_warp_mode)
+				const unsigned char *row0 = src_pixels + static_cast<size_t>(std::min(2 * y, src.height - 1)) * src.width * m_channel;
+				const unsigned char *row1 = src_pixels + static_cast<size_t>(std::min(2 * y + 1, src.height - 1)) * src.width * m_channel;
+				for (int x = 0; x < dst.width; ++x)
 				{
-				case TRTextureWarpMode::TR_REPEAT:
-					v = v > 0 ? (v % m_height) : (m_height - 1 + v % m_height);
-					break;
-				case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
-				default:
-					v = (v < 0) ? 0 : m_height - 1;
-					break;
+					const int x0 = std::min(2 * x, src.width - 1) * m_channel;
+					const int x1 = std::min(2 * x + 1, src.width - 1) * m_channel;
+					for (int c = 0; c < m_channel; ++c)
+					{
+						const int sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+						*dst_pixels++ = static_cast<unsigned char>((sum + 2) / 4);
+					}
 				}
 			}
+			m_levels.push_back(dst);
+		}
+	}
+
+	int TRTexture2D::warpCoordinate(int c, int size) const
+	{
+		//Handling out of range situation
+		if (c >= 0 && c < size)
+			return c;
+
+		switch (m_warp_mode)
+		{
+		case TRTextureWarpMode::TR_REPEAT:
+			return ((c % size) + size) % size;
+		case TRTextureWarpMode::TR_CLAMP_TO_EDGE:
+			return (c < 0) ? 0 : size - 1;
+		default:
+			return (c < 0) ? 0 : size - 1;
 		}
+	}
+
+	void TRTexture2D::readPixel(int level, int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const
+	{
+		const MipLevel &mip = m_levels[level];
+		u = warpCoordinate(u, mip.width);
+		v = warpCoordinate(v, mip.height);
 
-		int index = (v * m_height + u) * m_channel;
+		const size_t index = mip.offset + (static_cast<size_t>(v) * mip.width + u) * m_channel;
 		r = m_pixels[index + 0];
 		g = m_pixels[index + 1];
 		b = m_pixels[index + 2];
@@ -94,16 +121,31 @@ namespace TinyRenderer
 
 	void TRTexture2D::freeLoadedImage()
 	{
-		if (m_pixels != nullptr)
-		{
-			stbi_image_free(m_pixels);
-		}
-
-		m_pixels = nullptr;
+		std::vector<unsigned char>().swap(m_pixels);
+		std::vector<MipLevel>().swap(m_levels);
 		m_width = m_height = m_channel = 0;
 	}
 
+	float TRTexture2D::calcLod(const glm::vec4 &duv) const
+	{
+		//rho is the longer axis of the pixel footprint in texels of the base level, lod = log2(rho)
+		//Refs: The OpenGL Graphics System: A Specification (Version 4.6), 8.14.1 Scale Factor and Level of Detail
+		const float dudx = duv.x * m_width, dvdx = duv.y * m_height;
+		const float dudy = duv.z * m_width, dvdy = duv.w * m_height;
+		const float rho2 = std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+
+		//Magnification (or no derivatives) samples the base level
+		if (!(rho2 > 1.0f))
+			return 0.0f;
+		return std::min(0.5f * std::log2(rho2), static_cast<float>(m_levels.size() - 1));
+	}
+
 	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv) const
+	{
+		return sample(uv, glm::vec4(0.0f));
+	}
+
+	glm::vec4 TRTexture2D::sample(const glm::vec2 &uv, const glm::vec4 &duv) const
 	{
 		//Perform sampling procedure
 		//Note: return texel that ranges from 0.0f to 1.0f instead of [0,255]
@@ -116,6 +158,36 @@ namespace TinyRenderer
 		case TRTextureFilterMode::TR_LINEAR:
 			texel = TRTexture2DSampler::textureSampling_bilinear(*this, uv);
 			break;
+		case TRTextureFilterMode::TR_NEAREST_MIPMAP_NEAREST:
+		case TRTextureFilterMode::TR_LINEAR_MIPMAP_NEAREST:
+		{
+			//The nearest level
+			const int level = static_cast<int>(calcLod(duv) + 0.5f);
+			texel = (m_filtering_mode == TRTextureFilterMode::TR_NEAREST_MIPMAP_NEAREST) ?
+				TRTexture2DSampler::textureSampling_nearest(*this, uv, level) :
+				TRTexture2DSampler::textureSampling_bilinear(*this, uv, level);
+			break;
+		}
+		case TRTextureFilterMode::TR_NEAREST_MIPMAP_LINEAR:
+		case TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR:
+		{
+			//Linear interpolation between the two nearest levels
+			auto sample_level = [&](int level) -> glm::vec4
+			{
+				return (m_filtering_mode == TRTextureFilterMode::TR_NEAREST_MIPMAP_LINEAR) ?
+					TRTexture2DSampler::textureSampling_nearest(*this, uv, level) :
+					TRTexture2DSampler::textureSampling_bilinear(*this, uv, level);
+			};
+			const float lod = calcLod(duv);
+			const int level = static_cast<int>(lod);
+			const float frac = lod - level;
+			texel = sample_level(level);
+			if (frac > 0.0f)
+			{
+				texel = glm::mix(texel, sample_level(level + 1), frac);
+			}
+			break;
+		}
 		default:
 			break;
 		}
@@ -125,7 +197,7 @@ namespace TinyRenderer
 
 	//----------------------------------------------TRTexture2DSampler----------------------------------------------
 
-	glm::vec4 TRTexture2DSampler::textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv)
+	glm::vec4 TRTexture2DSampler::textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv, int level)
 	{
 		unsigned char r = 255, g = 255, b = 255, a = 255;
 
@@ -136,52 +208,46 @@ namespace TinyRenderer
 		{
 			float u = uv.x;
 			float v = uv.y;
-			int width = texture.getWidth();
-			int height = texture.getHeight();
+			int width = texture.m_levels[level].width;
+			int height = texture.m_levels[level].height;
 			int x = (int)(u * width - 1.0f);
 			int y = (int)(v * height - 1.0f);
 			// x = x < 0 ? width + x : x;
 			// y = y < 0 ? height + y : y;
-			texture.readPixel(x, y, r, g, b, a);
+			texture.readPixel(level, x, y, r, g, b, a);
 		}
 
 		constexpr float denom = 1.0f / 255.0f;
 		return glm::vec4(r, g, b, a) * denom;
 	}
 
-	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv)
+	glm::vec4 TRTexture2DSampler::textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level)
 	{
-		//Note: Delete this line when you try to implement Task 4. 
-/*		unsigned char r_0 = 255, g_0 = 255, b_0 = 255, a_0 = 255;
-		unsigned char r_1 = 255, g_1 = 255, b_1 = 255, a_1 = 255;
-		unsigned char r_2 = 255, g_2 = 255, b_2 = 255, a_2 = 255;
-		unsigned char r_3 = 255, g_3 = 255, b_3 = 255, a_3 = 255;
-		float frac1 = 0;
-		float frac2 = 0;
+		//Task4: Implement bilinear sampling algorithm for texture sampling
+		//Note: the texel centers are the same as the nearest sampling, i.e., texel x is picked for
+		//      u * width in [x + 1, x + 2), so the four texels around u * width - 1.5 are blended.
+		const TRTexture2D::MipLevel &mip = texture.m_levels[level];
+		const float u = uv.x * mip.width - 1.5f;
+		const float v = uv.y * mip.height - 1.5f;
+		const float x = std::floor(u);
+		const float y = std::floor(v);
+		const float frac1 = u - x;
+		const float frac2 = v - y;
+
+		//The coordinates are warped once per row/column instead of once per texel
+		const int channel = texture.m_channel;
+		const size_t x0 = texture.warpCoordinate((int)x, mip.width) * channel;
+		const size_t x1 = texture.warpCoordinate((int)x + 1, mip.width) * channel;
+		const unsigned char *row0 = &texture.m_pixels[mip.offset + static_cast<size_t>(texture.warpCoordinate((int)y, mip.height)) * mip.width * channel];
+		const unsigned char *row1 = &texture.m_pixels[mip.offset + static_cast<size_t>(texture.warpCoordinate((int)y + 1, mip.height)) * mip.width * channel];
+		auto texel = [channel](const unsigned char *p) -> glm::vec4
 		{
-			float u = uv.x;
-			float v = uv.y;
-			int width = texture.getWidth();
-			int height = texture.getHeight();
-			int x = (int)(u * width - 1.0f);
-			int y = (int)(v * height - 1.0f);
-			frac1 = u * width - 1.0f - x;
-			frac2 = v * height - 1.0f - y;
-			// x = x < 0 ? width + x : x;
-			// y = y < 0 ? height + y : y;
-			texture.readPixel(x, y, r_0, g_0, b_0, a_0);
-			texture.readPixel(x+1, y, r_1, g_1, b_1, a_1);
-			texture.readPixel(x, y+1, r_2, g_2, b_2, a_2);
-			texture.readPixel(x+1, y+1, r_3, g_3, b_3, a_3);
-		}
-		glm::vec4 tmp0 = { r_0 * (1 - frac1) + r_1 * frac1 ,  g_0 * (1 - frac1) + g_1 * frac1  , b_0 * (1 - frac1) + b_1 * frac1 , a_0 * (1 - frac1) + a_1 * frac1 };
-		glm::vec4 tmp1 = { r_2 * (1 - frac1) + r_3 * frac1 ,  g_2 * (1 - frac1) + g_3 * frac1  , b_2 * (1 - frac1) + b_3 * frac1 , a_2 * (1 - frac1) + a_3 * frac1 };
-		glm::vec4 result = { tmp0.x * (1 - frac2) + tmp1.x * frac2 , tmp0.y * (1 - frac2) + tmp1.y * frac2  , tmp0.z * (1 - frac2) + tmp1.z * frac2  , tmp0.w * (1 - frac2) + tmp1.w * frac2 };
+			return glm::vec4(p[0], p[1], p[2], (channel >= 4) ? p[3] : 255);
+		};
+
+		const glm::vec4 tmp0 = glm::mix(texel(row0 + x0), texel(row0 + x1), frac1);
+		const glm::vec4 tmp1 = glm::mix(texel(row1 + x0), texel(row1 + x1), frac1);
 		constexpr float denom = 1.0f / 255.0f;
-		return result * denom;*/
-		 return textureSampling_nearest(texture, uv);
-		//Task4: Implement bilinear sampling algorithm for texture sampling
-		// Note: You should use texture.readPixel() to read the pixel, and for instance, 
-		//       use texture.readPixel(25,35,r,g,b,a) to read the pixel in (25, 35).
+		return glm::mix(tmp0, tmp1, frac2) * denom;
 	}
 }
\ No newline at end of file
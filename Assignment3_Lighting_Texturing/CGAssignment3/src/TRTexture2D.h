@@ -2,6 +2,7 @@
 #define TRTEXTURE_2D_H
 
 #include <string>
+#include <vector>
 #include <memory>
 
 #include "glm/glm.hpp"
@@ -25,23 +26,42 @@ namespace TinyRenderer
 		int getWidth() const { return m_width; }
 		int getHeight() const { return m_height; }
 		int getChannel() const { return m_channel; }
+		int getNumberOfLevels() const { return static_cast<int>(m_levels.size()); }
 
+		//Note: the mip chain is built here whatever the filtering mode is, so that the mipmap modes can be
+		//      switched on later with setFilteringMode.
 		bool loadTextureFromFile(
 			const std::string &filepath,
 			TRTextureWarpMode warpMode = TRTextureWarpMode::TR_REPEAT,
 			TRTextureFilterMode filterMode = TRTextureFilterMode::TR_LINEAR);
 
 		//Sampling according to the given uv coordinate
+		//Note: without the derivatives the mipmap modes sample the base level.
 		glm::vec4 sample(const glm::vec2 &uv) const;
+		//duv is the screen space derivatives of uv: (du/dx, dv/dx, du/dy, dv/dy)
+		glm::vec4 sample(const glm::vec2 &uv, const glm::vec4 &duv) const;
+
+		//Level of detail of the footprint of a pixel, 0 is the base level
+		float calcLod(const glm::vec4 &duv) const;
 
 	private:
 		//Auxiliary functions
-		void readPixel(int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const;
+		int warpCoordinate(int c, int size) const;
+		void readPixel(int level, int u, int v, unsigned char &r, unsigned char &g, unsigned char &b, unsigned char &a) const;
+		void buildMipmaps();
 		void freeLoadedImage();
 
 	private:
+		//A level of the mip chain, each one is half the size of the previous one
+		struct MipLevel
+		{
+			int width, height;
+			size_t offset;    //First byte in m_pixels
+		};
+
 		int m_width, m_height, m_channel;
-		unsigned char *m_pixels;
+		std::vector<unsigned char> m_pixels;    //All the levels, the base level first
+		std::vector<MipLevel> m_levels;
 
 		TRTextureWarpMode m_warp_mode;
 		TRTextureFilterMode m_filtering_mode;
@@ -54,8 +74,8 @@ namespace TinyRenderer
 	public:
 
 		//Sampling algorithm
-		static glm::vec4 textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv);
-		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv);
+		static glm::vec4 textureSampling_nearest(const TRTexture2D &texture, glm::vec2 uv, int level = 0);
+		static glm::vec4 textureSampling_bilinear(const TRTexture2D &texture, glm::vec2 uv, int level = 0);
 	};
 }
 
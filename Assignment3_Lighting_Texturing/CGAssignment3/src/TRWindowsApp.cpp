@@ -122,7 +122,9 @@ namespace TinyRenderer
 		int height,
 		int channel,
 		unsigned int num_cliped_faces,
-		unsigned int num_culled_faces)
+		unsigned int num_culled_faces,
+		unsigned int num_culled_meshes,
+		float overdraw)
 	{
 		//Update pixels
 		SDL_LockSurface(m_screen_surface);
@@ -158,6 +160,8 @@ namespace TinyRenderer
 				ss << " FPS:" << std::setiosflags(std::ios::left) << std::setw(3) << m_fps;
 				ss << "#ClipedFaces:" << std::setiosflags(std::ios::left) << std::setw(5) << num_cliped_faces;
 				ss << "#CulledFaces:" << std::setiosflags(std::ios::left) << std::setw(5) << num_culled_faces;
+				ss << "#CulledMeshes:" << std::setiosflags(std::ios::left) << std::setw(3) << num_culled_meshes;
+				ss << "#Overdraw:" << std::setiosflags(std::ios::left) << std::setprecision(3) << overdraw;
 				SDL_SetWindowTitle(m_window_handle, (m_window_title + ss.str()).c_str());
 			}
 		}
@@ -75,7 +75,9 @@ namespace TinyRenderer
 			int height, 
 			int channel,
 			unsigned int num_cliped_faces,
-			unsigned int num_culled_faces);
+			unsigned int num_culled_faces,
+			unsigned int num_culled_meshes,
+			float overdraw);
 
 		static TRWindowsApp::ptr getInstance();
 		static TRWindowsApp::ptr getInstance(int width, int height, const std::string title = "winApp");
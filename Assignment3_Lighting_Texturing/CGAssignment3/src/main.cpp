@@ -28,6 +28,8 @@ THE SOFTWARE.*/
 #include "TRUtils.h"
 
 #include <iostream>
+#include <cstdlib>
+#include <thread>
 
 using namespace TinyRenderer;
 
@@ -45,6 +47,16 @@ int main(int argc, char* args[])
 
 	TRRenderer::ptr renderer = std::make_shared<TRRenderer>(width, height);
 
+	//Rendering threads: given by the first argument, all the hardware threads by default
+	int numThreads = (argc > 1) ? std::atoi(args[1]) : static_cast<int>(std::thread::hardware_concurrency());
+	renderer->setThreadNum(numThreads);
+
+	//Guard-band clipping: only the near/far planes clip the triangles close to the screen
+	renderer->setGuardBand(2.0f);
+
+	//Front-to-back draw order: the model in front of the floor is drawn first
+	renderer->setDrawOrder(TRDrawOrderMode::TR_DRAW_ORDER_FRONT_TO_BACK_CLUSTER);
+
 	//camera
 	glm::vec3 cameraPos = glm::vec3(0.8f, 0.0f, 3.7f);
 	glm::vec3 lookAtTarget = glm::vec3(0.0f);
@@ -53,7 +65,7 @@ int main(int argc, char* args[])
 	renderer->setProjectMatrix(TRUtils::calcPerspProjectMatrix(45.0f, static_cast<float>(width) / height, 0.001f, 10.0f), 0.001f, 10.0f);
 
 	//Load the rendering data
-	TRDrawableMesh::ptr diabloMesh = std::make_shared<TRDrawableMesh>("model/diablo3_pose/diablo3_pose.obj");
+	TRDrawableMesh::ptr diabloMesh = std::make_shared<TRDrawableMesh>("model/diablo3_pose/diablo3_pose.obj", true);
 	TRDrawableMesh::ptr houseMesh = std::make_shared<TRDrawableMesh>("model/floor.obj");
 	TRDrawableMesh::ptr redLightMesh = std::make_shared<TRDrawableMesh>("model/light_red.obj");
 	TRDrawableMesh::ptr greenLightMesh = std::make_shared<TRDrawableMesh>("model/light_green.obj");
@@ -63,6 +75,10 @@ int main(int argc, char* args[])
 	greenLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
 	blueLightMesh->setLightingMode(TRLightingMode::TR_LIGHTING_DISABLE);
 
+	//Mipmapped textures with trilinear filtering: fewer texels read for the distant surfaces, more work per sample
+	//for (int i = 0; TRShadingPipeline::getTexture2D(i) != nullptr; ++i)
+	//	TRShadingPipeline::getTexture2D(i)->setFilteringMode(TRTextureFilterMode::TR_LINEAR_MIPMAP_LINEAR);
+
 	winApp->readyToStart();
 
 	//Simple texture
@@ -122,7 +138,9 @@ int main(int argc, char* args[])
 			height,
 			4,
 			renderer->getNumberOfClipFaces(),
-			renderer->getNumberOfCullFaces());
+			renderer->getNumberOfCullFaces(),
+			renderer->getNumberOfCulledMeshes(),
+			renderer->getOverdraw());
 
 		//Model transformation
 		{